@@ -0,0 +1,682 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <deque>
+#include <cstdint>
+#include <climits>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/*
+    Native CPU backend (--backend cpu): init_t0, automaton_global and
+    color_watershed on a thread pool, without OpenCL.
+    The image is cut into CPU_TILE_SIZE x CPU_TILE_SIZE tiles, small enough
+    for a tile's lattice, labels and luma to stay in a core's L2 cache, and
+    each thread owns a contiguous range of them for the whole run. Steps are
+    Jacobi like on the device (t0 -> t1, then swap) with a barrier in
+    between, so the labels match the OpenCL modes bit for bit.
+ */
+#define CPU_TILE_SIZE 64
+
+class CPU_BARRIER {
+public:
+    CPU_BARRIER(int count) : count(count), waiting(0), generation(0) {}
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        int arrived_generation = generation;
+        if (++waiting == count) {
+            waiting = 0;
+            generation++;
+            released.notify_all();
+        }
+        else released.wait(lock, [&]{ return generation != arrived_generation; });
+    }
+
+private:
+    int count;
+    int waiting;
+    int generation;
+    std::mutex mutex;
+    std::condition_variable released;
+};
+
+typedef struct tagCPU_STATS {
+    int threads;
+    int tiles;
+    int steps;
+    const char *isa; // instruction set the automaton ran with
+    int visits; // tiles relaxed by the work stealing schedule
+    int steals;
+} CPU_STATS;
+
+int cpu_thread_count(int requested) {
+    if (requested > 0) return requested;
+    int hardware = std::thread::hardware_concurrency();
+    return hardware > 0 ? hardware : 1;
+}
+
+// add_sat of the kernels
+inline uint32_t add_sat_u32(uint32_t a, uint32_t b) {
+    uint32_t sum = a + b;
+    return sum < a ? UINT32_MAX : sum;
+}
+
+/*
+    One automaton_global step over the rows y0..y1 and columns x0..x1,
+    returns true if any pixel changed. Neighbors outside of the image are
+    skipped, which is what the kernel's select against MAX_INT amounts to.
+ */
+bool cpu_automaton_rect(
+        const uint8_t *luma,
+        int width,
+        int height,
+        const uint32_t *t0_lattice,
+        const uint32_t *t0_labels,
+        uint32_t *t1_lattice,
+        uint32_t *t1_labels,
+        int x0,
+        int y0,
+        int x1,
+        int y1) {
+
+    bool changed = false;
+    for (int y=y0; y<y1; y++) {
+        for (int x=x0; x<x1; x++) {
+            uint32_t pos = x + y*width;
+            uint32_t pixel = luma[pos];
+            uint32_t best = t0_lattice[pos];
+            uint32_t from = pos;
+            // north, east, south, west, as in the kernel
+            if (y != 0) {
+                uint32_t cand = add_sat_u32(t0_lattice[pos-width], pixel);
+                if (best > cand) { best = cand; from = pos-width; }
+            }
+            if (x != width-1) {
+                uint32_t cand = add_sat_u32(t0_lattice[pos+1], pixel);
+                if (best > cand) { best = cand; from = pos+1; }
+            }
+            if (y != height-1) {
+                uint32_t cand = add_sat_u32(t0_lattice[pos+width], pixel);
+                if (best > cand) { best = cand; from = pos+width; }
+            }
+            if (x != 0) {
+                uint32_t cand = add_sat_u32(t0_lattice[pos-1], pixel);
+                if (best > cand) { best = cand; from = pos-1; }
+            }
+            uint32_t newlabel = t0_labels[from];
+            t1_lattice[pos] = best;
+            t1_labels[pos] = newlabel;
+            changed = changed || t0_lattice[pos] != best || t0_labels[pos] != newlabel;
+        }
+    }
+    return changed;
+}
+
+typedef bool (*CPU_AUTOMATON_FN)(
+        const uint8_t *luma,
+        int width,
+        int height,
+        const uint32_t *t0_lattice,
+        const uint32_t *t0_labels,
+        uint32_t *t1_lattice,
+        uint32_t *t1_labels,
+        int x0,
+        int y0,
+        int x1,
+        int y1);
+
+#ifdef CPU_X86_SIMD
+/*
+    Vectorized cpu_automaton_rect, 8 (AVX2) or 16 (AVX-512) pixels of a row
+    at a time; the first and last column and the row remainders go through
+    the scalar version.
+    There is no saturating 32 bit add, but add_sat(a, b) = min(a, ~b) + b.
+    The north and south candidates are dropped for the first and last row,
+    like the kernel's select against MAX_INT, and the strict > ties of the
+    kernel are kept by only taking a candidate's position where it is
+    strictly smaller than the best so far. The labels are gathered.
+    Positions are signed 32 bit lanes, so images must stay below 2^31 pixels.
+ */
+__attribute__((target("avx2")))
+inline void cpu_relax_avx2(__m256i &best, __m256i &from, __m256i neighbor, __m256i pixel, __m256i neighbor_pos) {
+    __m256i not_pixel = _mm256_xor_si256(pixel, _mm256_set1_epi32(-1));
+    __m256i cand = _mm256_add_epi32(_mm256_min_epu32(neighbor, not_pixel), pixel);
+    __m256i keep = _mm256_cmpeq_epi32(_mm256_min_epu32(best, cand), best);
+    best = _mm256_min_epu32(best, cand);
+    from = _mm256_blendv_epi8(neighbor_pos, from, keep);
+}
+
+__attribute__((target("avx2")))
+bool cpu_automaton_rect_avx2(
+        const uint8_t *luma,
+        int width,
+        int height,
+        const uint32_t *t0_lattice,
+        const uint32_t *t0_labels,
+        uint32_t *t1_lattice,
+        uint32_t *t1_labels,
+        int x0,
+        int y0,
+        int x1,
+        int y1) {
+
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i row = _mm256_set1_epi32(width);
+    const __m256i one = _mm256_set1_epi32(1);
+    __m256i diff = _mm256_setzero_si256();
+    bool changed = false;
+    for (int y=y0; y<y1; y++) {
+        int xs = std::max(x0, 1);
+        int xe = std::min(x1, width-1);
+        if (xs >= xe) {
+            changed = cpu_automaton_rect(luma, width, height, t0_lattice, t0_labels, t1_lattice, t1_labels, x0, y, x1, y+1) || changed;
+            continue;
+        }
+        if (x0 < xs) changed = cpu_automaton_rect(luma, width, height, t0_lattice, t0_labels, t1_lattice, t1_labels, x0, y, xs, y+1) || changed;
+        int x = xs;
+        for (; x+8 <= xe; x+=8) {
+            int pos = x + y*width;
+            __m256i vpos = _mm256_add_epi32(_mm256_set1_epi32(pos), lanes);
+            __m256i pixel = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(luma+pos)));
+            __m256i lattice = _mm256_loadu_si256((const __m256i*)(t0_lattice+pos));
+            __m256i best = lattice;
+            __m256i from = vpos;
+            // north, east, south, west, as in the kernel
+            if (y != 0) cpu_relax_avx2(best, from,
+                _mm256_loadu_si256((const __m256i*)(t0_lattice+pos-width)), pixel, _mm256_sub_epi32(vpos, row));
+            cpu_relax_avx2(best, from,
+                _mm256_loadu_si256((const __m256i*)(t0_lattice+pos+1)), pixel, _mm256_add_epi32(vpos, one));
+            if (y != height-1) cpu_relax_avx2(best, from,
+                _mm256_loadu_si256((const __m256i*)(t0_lattice+pos+width)), pixel, _mm256_add_epi32(vpos, row));
+            cpu_relax_avx2(best, from,
+                _mm256_loadu_si256((const __m256i*)(t0_lattice+pos-1)), pixel, _mm256_sub_epi32(vpos, one));
+            __m256i newlabel = _mm256_i32gather_epi32((const int*)t0_labels, from, 4);
+            _mm256_storeu_si256((__m256i*)(t1_lattice+pos), best);
+            _mm256_storeu_si256((__m256i*)(t1_labels+pos), newlabel);
+            __m256i labels = _mm256_loadu_si256((const __m256i*)(t0_labels+pos));
+            diff = _mm256_or_si256(diff, _mm256_or_si256(
+                _mm256_xor_si256(lattice, best), _mm256_xor_si256(labels, newlabel)));
+        }
+        if (x < xe) changed = cpu_automaton_rect(luma, width, height, t0_lattice, t0_labels, t1_lattice, t1_labels, x, y, xe, y+1) || changed;
+        if (xe < x1) changed = cpu_automaton_rect(luma, width, height, t0_lattice, t0_labels, t1_lattice, t1_labels, xe, y, x1, y+1) || changed;
+    }
+    return changed || !_mm256_testz_si256(diff, diff);
+}
+
+__attribute__((target("avx512f")))
+inline void cpu_relax_avx512(__m512i &best, __m512i &from, __m512i neighbor, __m512i pixel, __m512i neighbor_pos) {
+    __m512i not_pixel = _mm512_xor_si512(pixel, _mm512_set1_epi32(-1));
+    // the maskz_ forms with every lane set are the plain ones, without the
+    // undefined pass-through operand GCC warns about
+    __m512i cand = _mm512_add_epi32(_mm512_maskz_min_epu32(0xFFFF, neighbor, not_pixel), pixel);
+    __mmask16 take = _mm512_cmpgt_epu32_mask(best, cand);
+    best = _mm512_mask_blend_epi32(take, best, cand);
+    from = _mm512_mask_blend_epi32(take, from, neighbor_pos);
+}
+
+__attribute__((target("avx512f")))
+bool cpu_automaton_rect_avx512(
+        const uint8_t *luma,
+        int width,
+        int height,
+        const uint32_t *t0_lattice,
+        const uint32_t *t0_labels,
+        uint32_t *t1_lattice,
+        uint32_t *t1_labels,
+        int x0,
+        int y0,
+        int x1,
+        int y1) {
+
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i row = _mm512_set1_epi32(width);
+    const __m512i one = _mm512_set1_epi32(1);
+    __m512i diff = _mm512_setzero_si512();
+    bool changed = false;
+    for (int y=y0; y<y1; y++) {
+        int xs = std::max(x0, 1);
+        int xe = std::min(x1, width-1);
+        if (xs >= xe) {
+            changed = cpu_automaton_rect(luma, width, height, t0_lattice, t0_labels, t1_lattice, t1_labels, x0, y, x1, y+1) || changed;
+            continue;
+        }
+        if (x0 < xs) changed = cpu_automaton_rect(luma, width, height, t0_lattice, t0_labels, t1_lattice, t1_labels, x0, y, xs, y+1) || changed;
+        int x = xs;
+        for (; x+16 <= xe; x+=16) {
+            int pos = x + y*width;
+            __m512i vpos = _mm512_add_epi32(_mm512_set1_epi32(pos), lanes);
+            __m512i pixel = _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm_loadu_si128((const __m128i*)(luma+pos)));
+            __m512i lattice = _mm512_loadu_si512((const void*)(t0_lattice+pos));
+            __m512i best = lattice;
+            __m512i from = vpos;
+            if (y != 0) cpu_relax_avx512(best, from,
+                _mm512_loadu_si512((const void*)(t0_lattice+pos-width)), pixel, _mm512_sub_epi32(vpos, row));
+            cpu_relax_avx512(best, from,
+                _mm512_loadu_si512((const void*)(t0_lattice+pos+1)), pixel, _mm512_add_epi32(vpos, one));
+            if (y != height-1) cpu_relax_avx512(best, from,
+                _mm512_loadu_si512((const void*)(t0_lattice+pos+width)), pixel, _mm512_add_epi32(vpos, row));
+            cpu_relax_avx512(best, from,
+                _mm512_loadu_si512((const void*)(t0_lattice+pos-1)), pixel, _mm512_sub_epi32(vpos, one));
+            __m512i newlabel = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, from, (const void*)t0_labels, 4);
+            _mm512_storeu_si512((void*)(t1_lattice+pos), best);
+            _mm512_storeu_si512((void*)(t1_labels+pos), newlabel);
+            __m512i labels = _mm512_loadu_si512((const void*)(t0_labels+pos));
+            diff = _mm512_or_si512(diff, _mm512_or_si512(
+                _mm512_xor_si512(lattice, best), _mm512_xor_si512(labels, newlabel)));
+        }
+        if (x < xe) changed = cpu_automaton_rect(luma, width, height, t0_lattice, t0_labels, t1_lattice, t1_labels, x, y, xe, y+1) || changed;
+        if (xe < x1) changed = cpu_automaton_rect(luma, width, height, t0_lattice, t0_labels, t1_lattice, t1_labels, xe, y, x1, y+1) || changed;
+    }
+    return changed || _mm512_test_epi32_mask(diff, diff) != 0;
+}
+#endif
+
+// picks the widest automaton step the CPU runs, the scalar one without simd
+CPU_AUTOMATON_FN cpu_select_automaton(bool simd, int width, int height, const char **isa) {
+#ifdef CPU_X86_SIMD
+    if (simd && (long long)width*height < INT32_MAX) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            *isa = "AVX-512";
+            return cpu_automaton_rect_avx512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            *isa = "AVX2";
+            return cpu_automaton_rect_avx2;
+        }
+    }
+#endif
+    *isa = "scalar";
+    return cpu_automaton_rect;
+}
+
+// same as init_t0
+void cpu_init_t0(const std::vector<uint8_t> &gradient, std::vector<uint32_t> &lattice, std::vector<uint32_t> &labels) {
+    lattice.resize(gradient.size());
+    labels.resize(gradient.size());
+    for (size_t i=0; i<gradient.size(); i++) {
+        lattice[i] = gradient[i] == 0 ? 0 : UINT32_MAX;
+        labels[i] = gradient[i] == 0 ? (uint32_t)i : 0;
+    }
+}
+
+/*
+    Runs the automaton on threads threads until convergence; labels gets the
+    converged labels.
+    A step's changes are flagged in changed[step % 3]: every thread reads the
+    flag of a step after the barrier that ends it, and thread 0 clears the
+    flag of the next step meanwhile, which nobody has read since two
+    barriers ago.
+ */
+CPU_STATS run_cpu_automaton(
+        const std::vector<uint8_t> &luma,
+        const std::vector<uint8_t> &gradient,
+        int width,
+        int height,
+        int threads,
+        bool simd,
+        std::vector<uint32_t> &labels) {
+
+    const char *isa;
+    CPU_AUTOMATON_FN automaton_rect = cpu_select_automaton(simd, width, height, &isa);
+
+    std::vector<uint32_t> lattice[2];
+    std::vector<uint32_t> label_buffers[2];
+    cpu_init_t0(gradient, lattice[0], label_buffers[0]);
+    lattice[1].resize(lattice[0].size());
+    label_buffers[1].resize(label_buffers[0].size());
+
+    int tiles_x = (width+CPU_TILE_SIZE-1)/CPU_TILE_SIZE;
+    int tiles_y = (height+CPU_TILE_SIZE-1)/CPU_TILE_SIZE;
+    int tiles = tiles_x*tiles_y;
+    threads = std::max(1, std::min(threads, tiles));
+
+    CPU_BARRIER barrier(threads);
+    std::atomic<int> changed[3];
+    for (int i=0; i<3; i++) changed[i] = 0;
+    int steps = 0;
+
+    auto worker = [&](int id) {
+        int tile_begin = (int)((long long)tiles*id/threads);
+        int tile_end = (int)((long long)tiles*(id+1)/threads);
+        int current = 0;
+        for (int step=0;; step++) {
+            if (id == 0) changed[(step+1)%3] = 0;
+            bool any = false;
+            for (int t=tile_begin; t<tile_end; t++) {
+                int x0 = (t%tiles_x)*CPU_TILE_SIZE;
+                int y0 = (t/tiles_x)*CPU_TILE_SIZE;
+                any = automaton_rect(
+                            &luma[0],
+                            width,
+                            height,
+                            &lattice[current][0],
+                            &label_buffers[current][0],
+                            &lattice[1-current][0],
+                            &label_buffers[1-current][0],
+                            x0,
+                            y0,
+                            std::min(x0+CPU_TILE_SIZE, width),
+                            std::min(y0+CPU_TILE_SIZE, height)) || any;
+            }
+            if (any) changed[step%3] = 1;
+            barrier.wait();
+            current = 1-current;
+            if (!changed[step%3]) {
+                if (id == 0) steps = step+1;
+                break;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i=1; i<threads; i++) pool.push_back(std::thread(worker, i));
+    worker(0);
+    for (size_t i=0; i<pool.size(); i++) pool[i].join();
+
+    // the last step changed nothing, both buffers hold the result
+    labels.swap(label_buffers[0]);
+
+    CPU_STATS stats = {threads, tiles, steps, isa, 0, 0};
+    return stats;
+}
+
+/*
+    Work stealing schedule (--cpuschedule steal). Convergence is uneven:
+    flat areas settle in a few steps while textured ones keep changing, so
+    instead of lockstep steps over a static partition every tile is relaxed
+    on its own until it is stable, and only the tiles next to a border that
+    changed are queued again.
+    Lattice and label share one 64 bit word (cost << 32 | label, like
+    init_t0_packed) so that a pixel is read and written atomically, and
+    values are only ever lowered with a compare and swap; as in
+    automaton_inplace, candidates compare as packed values, which makes the
+    fixed point independent of the schedule: the labels are the inplace
+    automaton's (ties to the lowest label), not the Jacobi ones.
+    Each thread owns a deque of tiles, pops the newest one and steals the
+    oldest one of another thread when its own is empty. A tile is queued at
+    most once at a time; it's unflagged when popped, before reading its halo,
+    so a border written meanwhile queues it again. pending counts the tiles
+    queued or being relaxed, everything is stable when it drops to zero.
+ */
+class CPU_WORK_DEQUE {
+public:
+    void push(int tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tiles.push_back(tile);
+    }
+
+    bool pop(int &tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tiles.empty()) return false;
+        tile = tiles.back();
+        tiles.pop_back();
+        return true;
+    }
+
+    bool steal(int &tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tiles.empty()) return false;
+        tile = tiles.front();
+        tiles.pop_front();
+        return true;
+    }
+
+private:
+    std::deque<int> tiles;
+    std::mutex mutex;
+};
+
+inline uint64_t cpu_packed_candidate(uint64_t neighbor, uint32_t pixel) {
+    return ((uint64_t)add_sat_u32((uint32_t)(neighbor >> 32), pixel) << 32) | (neighbor & 0xFFFFFFFFull);
+}
+
+CPU_STATS run_cpu_steal(
+        const std::vector<uint8_t> &luma,
+        const std::vector<uint8_t> &gradient,
+        int width,
+        int height,
+        int threads,
+        std::vector<uint32_t> &labels) {
+
+    size_t size = (size_t)width*height;
+    std::vector<std::atomic<uint64_t> > packed(size);
+    for (size_t i=0; i<size; i++) {
+        // same as init_t0_packed
+        packed[i].store(gradient[i] == 0 ? (uint64_t)i : (uint64_t)UINT32_MAX << 32, std::memory_order_relaxed);
+    }
+
+    int tiles_x = (width+CPU_TILE_SIZE-1)/CPU_TILE_SIZE;
+    int tiles_y = (height+CPU_TILE_SIZE-1)/CPU_TILE_SIZE;
+    int tiles = tiles_x*tiles_y;
+    threads = std::max(1, std::min(threads, tiles));
+
+    std::vector<CPU_WORK_DEQUE> deques(threads);
+    std::vector<std::atomic<int> > queued(tiles);
+    std::atomic<int> pending(tiles);
+    std::atomic<int> visits(0);
+    std::atomic<int> steals(0);
+    for (int id=0; id<threads; id++) {
+        // contiguous ranges to start with, like the static schedule
+        int tile_begin = (int)((long long)tiles*id/threads);
+        int tile_end = (int)((long long)tiles*(id+1)/threads);
+        for (int t=tile_end-1; t>=tile_begin; t--) {
+            queued[t] = 1;
+            deques[id].push(t);
+        }
+    }
+
+    auto enqueue = [&](int id, int tile) {
+        if (queued[tile].exchange(1)) return;
+        pending++;
+        deques[id].push(tile);
+    };
+
+    auto worker = [&](int id) {
+        std::vector<uint64_t> local((CPU_TILE_SIZE+2)*(CPU_TILE_SIZE+2));
+        int tile;
+        while (true) {
+            bool found = deques[id].pop(tile);
+            for (int i=1; !found && i<threads; i++) {
+                found = deques[(id+i)%threads].steal(tile);
+                if (found) steals++;
+            }
+            if (!found) {
+                if (pending == 0) return;
+                std::this_thread::yield();
+                continue;
+            }
+            // acquires whatever the writers of the halo stored before queueing this tile
+            queued[tile].exchange(0);
+            visits++;
+
+            int x0 = (tile%tiles_x)*CPU_TILE_SIZE;
+            int y0 = (tile/tiles_x)*CPU_TILE_SIZE;
+            int tw = std::min(CPU_TILE_SIZE, width-x0);
+            int th = std::min(CPU_TILE_SIZE, height-y0);
+            int hw = tw+2;
+
+            // gather the tile and its halo, MAX outside of the image
+            for (int y=-1; y<=th; y++) {
+                for (int x=-1; x<=tw; x++) {
+                    int gx = x0+x;
+                    int gy = y0+y;
+                    local[(x+1) + (y+1)*hw] = gx < 0 || gy < 0 || gx >= width || gy >= height ?
+                        UINT64_MAX : packed[gx + (size_t)gy*width].load(std::memory_order_relaxed);
+                }
+            }
+
+            // relax in place until stable, alternating the sweep direction so
+            // that values travel across the tile both ways; the halo stays as read
+            bool changed = true;
+            for (int pass=0; changed; pass++) {
+                changed = false;
+                bool forward = pass%2 == 0;
+                for (int j=1; j<=th; j++) {
+                    int y = forward ? j : th+1-j;
+                    for (int i=1; i<=tw; i++) {
+                        int x = forward ? i : tw+1-i;
+                        int pos = x + y*hw;
+                        uint32_t pixel = luma[(x0+x-1) + (size_t)(y0+y-1)*width];
+                        uint64_t best = local[pos];
+                        best = std::min(best, cpu_packed_candidate(local[pos-hw], pixel));
+                        best = std::min(best, cpu_packed_candidate(local[pos+1], pixel));
+                        best = std::min(best, cpu_packed_candidate(local[pos+hw], pixel));
+                        best = std::min(best, cpu_packed_candidate(local[pos-1], pixel));
+                        if (best < local[pos]) {
+                            local[pos] = best;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+
+            // write back what got lower, queueing the tiles across the borders that did
+            bool lowered_north = false, lowered_south = false, lowered_west = false, lowered_east = false;
+            for (int y=0; y<th; y++) {
+                for (int x=0; x<tw; x++) {
+                    uint64_t value = local[(x+1) + (y+1)*hw];
+                    std::atomic<uint64_t> &cell = packed[(x0+x) + (size_t)(y0+y)*width];
+                    uint64_t old = cell.load(std::memory_order_relaxed);
+                    bool lowered = false;
+                    while (value < old) {
+                        if (cell.compare_exchange_weak(old, value, std::memory_order_relaxed)) {
+                            lowered = true;
+                            break;
+                        }
+                    }
+                    if (!lowered) continue;
+                    if (y == 0) lowered_north = true;
+                    if (y == th-1) lowered_south = true;
+                    if (x == 0) lowered_west = true;
+                    if (x == tw-1) lowered_east = true;
+                }
+            }
+            int tx = tile%tiles_x;
+            int ty = tile/tiles_x;
+            if (lowered_north && ty > 0) enqueue(id, tile-tiles_x);
+            if (lowered_south && ty < tiles_y-1) enqueue(id, tile+tiles_x);
+            if (lowered_west && tx > 0) enqueue(id, tile-1);
+            if (lowered_east && tx < tiles_x-1) enqueue(id, tile+1);
+            pending--;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i=1; i<threads; i++) pool.push_back(std::thread(worker, i));
+    worker(0);
+    for (size_t i=0; i<pool.size(); i++) pool[i].join();
+
+    labels.resize(size);
+    for (size_t i=0; i<size; i++) labels[i] = (uint32_t)packed[i].load(std::memory_order_relaxed);
+
+    CPU_STATS stats = {threads, tiles, 0, "scalar", visits, steals};
+    return stats;
+}
+
+/*
+    Raster sweeps (--cpuschedule sweep). Like a two pass chamfer distance
+    transform, the pixels are relaxed in place in raster order, alternating
+    forward (top left to bottom right) and backward passes until one
+    changes nothing: a minimum runs along a whole row in a single pass
+    instead of one pixel per automaton step. Same packed values and fixed
+    point as the work stealing schedule.
+    The rows of a pass run in parallel as a wavefront: a row only relaxes a
+    chunk of CPU_SWEEP_CHUNK columns once the previous row (in pass order)
+    is done with it, so every pixel reads its previous neighbor already
+    updated and its next one not yet touched, exactly like a sequential
+    pass. progress[y] counts the chunks row y finished, over all passes so
+    far, so it never needs a reset.
+ */
+#define CPU_SWEEP_CHUNK 64
+
+CPU_STATS run_cpu_sweep(
+        const std::vector<uint8_t> &luma,
+        const std::vector<uint8_t> &gradient,
+        int width,
+        int height,
+        int threads,
+        std::vector<uint32_t> &labels) {
+
+    size_t size = (size_t)width*height;
+    std::vector<uint64_t> packed(size);
+    for (size_t i=0; i<size; i++) {
+        // same as init_t0_packed
+        packed[i] = gradient[i] == 0 ? (uint64_t)i : (uint64_t)UINT32_MAX << 32;
+    }
+
+    int chunks = (width+CPU_SWEEP_CHUNK-1)/CPU_SWEEP_CHUNK;
+    threads = std::max(1, std::min(threads, height));
+
+    std::vector<std::atomic<long long> > progress(height);
+    for (int y=0; y<height; y++) progress[y] = 0;
+    CPU_BARRIER barrier(threads);
+    std::atomic<int> changed[3];
+    for (int i=0; i<3; i++) changed[i] = 0;
+    int passes = 0;
+
+    auto worker = [&](int id) {
+        for (int pass=0;; pass++) {
+            if (id == 0) changed[(pass+1)%3] = 0;
+            bool forward = pass%2 == 0;
+            long long pass_base = (long long)pass*chunks;
+            bool any = false;
+            // rows are dealt round robin, so that consecutive rows run on different threads
+            for (int j=id; j<height; j+=threads) {
+                int y = forward ? j : height-1-j;
+                int previous = forward ? y-1 : y+1;
+                bool first_row = j == 0;
+                for (int c=0; c<chunks; c++) {
+                    int chunk = forward ? c : chunks-1-c;
+                    if (!first_row) {
+                        while (progress[previous].load(std::memory_order_acquire) < pass_base+c+1)
+                            std::this_thread::yield();
+                    }
+                    int xb = chunk*CPU_SWEEP_CHUNK;
+                    int xe = std::min(xb+CPU_SWEEP_CHUNK, width);
+                    for (int i=0; i<xe-xb; i++) {
+                        int x = forward ? xb+i : xe-1-i;
+                        size_t pos = x + (size_t)y*width;
+                        uint32_t pixel = luma[pos];
+                        uint64_t best = packed[pos];
+                        if (y != 0) best = std::min(best, cpu_packed_candidate(packed[pos-width], pixel));
+                        if (x != width-1) best = std::min(best, cpu_packed_candidate(packed[pos+1], pixel));
+                        if (y != height-1) best = std::min(best, cpu_packed_candidate(packed[pos+width], pixel));
+                        if (x != 0) best = std::min(best, cpu_packed_candidate(packed[pos-1], pixel));
+                        if (best < packed[pos]) {
+                            packed[pos] = best;
+                            any = true;
+                        }
+                    }
+                    progress[y].store(pass_base+c+1, std::memory_order_release);
+                }
+            }
+            if (any) changed[pass%3] = 1;
+            barrier.wait();
+            if (!changed[pass%3]) {
+                if (id == 0) passes = pass+1;
+                break;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i=1; i<threads; i++) pool.push_back(std::thread(worker, i));
+    worker(0);
+    for (size_t i=0; i<pool.size(); i++) pool[i].join();
+
+    labels.resize(size);
+    for (size_t i=0; i<size; i++) labels[i] = (uint32_t)packed[i];
+
+    CPU_STATS stats = {threads, height, passes, "scalar", 0, 0};
+    return stats;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+/*
+    Priority flood watershed (--backend flood), sequential.
+    The seeds are init_t0's (gradient == 0, cost 0, labelled with their own
+    position) and the flood grows them in order of the same cost the
+    automaton converges to, the luma summed along the path, so the basins
+    are the automaton's up to pixels reached at the same cost from two
+    seeds.
+    A step adds the luma of the pixel entered, at most 255, so all the
+    costs waiting in the queue lie within 256 of the lowest one: the
+    queue is 256 FIFO buckets indexed by cost modulo 256, and every pixel
+    is pushed and popped a bounded number of times, O(n) overall.
+ */
+#define FLOOD_BUCKETS 256
+
+typedef struct tagFLOOD_STATS {
+    int seeds;
+    size_t pushes;
+} FLOOD_STATS;
+
+FLOOD_STATS run_flood(
+        const std::vector<uint8_t> &luma,
+        const std::vector<uint8_t> &gradient,
+        int width,
+        int height,
+        std::vector<uint32_t> &labels) {
+
+    size_t size = (size_t)width*height;
+    std::vector<uint32_t> cost(size, UINT32_MAX);
+    labels.assign(size, 0); // never reached pixels keep init_t0's label
+    std::vector<std::vector<uint32_t> > buckets(FLOOD_BUCKETS);
+
+    FLOOD_STATS stats = {0, 0};
+    for (size_t i=0; i<size; i++) {
+        if (gradient[i] != 0) continue;
+        cost[i] = 0;
+        labels[i] = (uint32_t)i;
+        buckets[0].push_back((uint32_t)i);
+        stats.seeds++;
+    }
+    size_t queued = stats.seeds;
+    stats.pushes = queued;
+
+    for (uint32_t level=0; queued > 0; level++) {
+        std::vector<uint32_t> &bucket = buckets[level % FLOOD_BUCKETS];
+        // zero luma neighbors are appended to the bucket being drained
+        for (size_t i=0; i<bucket.size(); i++) {
+            uint32_t pos = bucket[i];
+            queued--;
+            if (cost[pos] != level) continue; // reached cheaper after being queued
+            int x = pos % width;
+            int y = pos / width;
+            // north, east, south, west, as in the automaton
+            uint32_t neighbors[4];
+            int count = 0;
+            if (y != 0) neighbors[count++] = pos-width;
+            if (x != width-1) neighbors[count++] = pos+1;
+            if (y != height-1) neighbors[count++] = pos+width;
+            if (x != 0) neighbors[count++] = pos-1;
+            for (int n=0; n<count; n++) {
+                uint32_t neighbor = neighbors[n];
+                uint32_t neighbor_cost = level + luma[neighbor];
+                if (neighbor_cost >= cost[neighbor]) continue;
+                cost[neighbor] = neighbor_cost;
+                labels[neighbor] = labels[pos];
+                buckets[neighbor_cost % FLOOD_BUCKETS].push_back(neighbor);
+                queued++;
+                stats.pushes++;
+            }
+        }
+        bucket.clear();
+    }
+
+    return stats;
+}
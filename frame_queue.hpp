@@ -0,0 +1,48 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/*
+    Bounded blocking queue handing frames between the pipeline stages.
+    push() blocks while the queue is full, so a fast producer can't run
+    arbitrarily far ahead of the consumer; close() wakes up the consumer
+    once the producer is done, pop() then returns false when it's empty.
+ */
+template <typename T>
+class FRAME_QUEUE {
+public:
+    FRAME_QUEUE(size_t capacity) : capacity(capacity), closed(false) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]{ return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]{ return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::unique_lock<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
@@ -14,6 +14,11 @@ typedef struct tagBMPSIZE {
 } *PBMPSIZE, BMPSIZE;
 
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
 
 void read_ppm(std::string path, BMPVEC& buffer, int& width, int& height) {
     std::ifstream file(path, std::ios::binary);
@@ -52,9 +57,9 @@ void read_ppm(std::string path, BMPVEC& buffer, int& width, int& height) {
 }
 
 void bgr2bgra(BMPVEC& rawbmp, BMPVEC& bgravec) {
-    bgravec.reserve(rawbmp.size() + rawbmp.size()/3);
-    int k = 0;
-    for (uint i = 0; i < rawbmp.size(); i+=3) {
+    bgravec.resize(rawbmp.size() + rawbmp.size()/3);
+    size_t k = 0;
+    for (size_t i = 0; i < rawbmp.size(); i+=3) {
         bgravec[k] = rawbmp[i];
         bgravec[k+1] = rawbmp[i+1];
         bgravec[k+2] = rawbmp[i+2];
@@ -63,10 +68,160 @@ void bgr2bgra(BMPVEC& rawbmp, BMPVEC& bgravec) {
     }
 }
 
-void rgba2rgb(unsigned char* invec, int size, unsigned char* outvec) {
+typedef struct tagRECT {
+    int x;
+    int y;
+    int width;
+    int height;
+} RECT;
+
+bool rects_overlap(const RECT& a, const RECT& b) {
+    return a.x < b.x+b.width && b.x < a.x+a.width &&
+        a.y < b.y+b.height && b.y < a.y+a.height;
+}
+
+RECT rect_union(const RECT& a, const RECT& b) {
+    int x0 = std::min(a.x, b.x);
+    int y0 = std::min(a.y, b.y);
+    int x1 = std::max(a.x+a.width, b.x+b.width);
+    int y1 = std::max(a.y+a.height, b.y+b.height);
+    return RECT{x0, y0, x1-x0, y1-y0};
+}
+
+RECT grow_rect(const RECT& r, int margin, int width, int height) {
+    int x0 = std::max(r.x-margin, 0);
+    int y0 = std::max(r.y-margin, 0);
+    int x1 = std::min(r.x+r.width+margin, width);
+    int y1 = std::min(r.y+r.height+margin, height);
+    return RECT{x0, y0, x1-x0, y1-y0};
+}
+
+// merges overlapping rectangles until no pixel belongs to two of them
+void merge_rects(std::vector<RECT>& rects) {
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i=0; i<rects.size() && !merged; i++) {
+            for (size_t j=i+1; j<rects.size(); j++) {
+                if (rects_overlap(rects[i], rects[j])) {
+                    rects[i] = rect_union(rects[i], rects[j]);
+                    rects.erase(rects.begin()+j);
+                    merged = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*
+    Bounding boxes of the areas that differ between two images of the same
+    size: the images are compared in block x block tiles, connected changed
+    tiles make up an area, whose box is grown by margin. Boxes overlapping
+    after growing are merged, so no pixel belongs to two of them.
+ */
+std::vector<RECT> changed_rects(
+        const BMPVEC& prev,
+        const BMPVEC& cur,
+        int width,
+        int height,
+        int channels,
+        int block,
+        int margin) {
+
+    int blocks_x = (width+block-1)/block;
+    int blocks_y = (height+block-1)/block;
+    std::vector<char> changed(blocks_x*blocks_y, 0);
+
+    for (int y=0; y<height; y++) {
+        for (int bx=0; bx<blocks_x; bx++) {
+            int i = bx + (y/block)*blocks_x;
+            if (changed[i]) continue;
+            size_t offset = ((size_t)y*width + bx*block)*channels;
+            size_t length = std::min(block, width-bx*block)*channels;
+            if (memcmp(&prev[offset], &cur[offset], length)) changed[i] = 1;
+        }
+    }
+
+    std::vector<RECT> rects;
+    std::vector<int> stack;
+    for (int i=0; i<blocks_x*blocks_y; i++) {
+        if (changed[i] != 1) continue;
+        // flood the connected (8-neighborhood) changed tiles, 2 marks them visited
+        int min_x = blocks_x, min_y = blocks_y, max_x = 0, max_y = 0;
+        changed[i] = 2;
+        stack.push_back(i);
+        while (!stack.empty()) {
+            int t = stack.back();
+            stack.pop_back();
+            int tx = t % blocks_x;
+            int ty = t / blocks_x;
+            min_x = std::min(min_x, tx);
+            min_y = std::min(min_y, ty);
+            max_x = std::max(max_x, tx);
+            max_y = std::max(max_y, ty);
+            for (int ny=std::max(ty-1, 0); ny<=std::min(ty+1, blocks_y-1); ny++) {
+                for (int nx=std::max(tx-1, 0); nx<=std::min(tx+1, blocks_x-1); nx++) {
+                    if (changed[nx + ny*blocks_x] == 1) {
+                        changed[nx + ny*blocks_x] = 2;
+                        stack.push_back(nx + ny*blocks_x);
+                    }
+                }
+            }
+        }
+        RECT area = {min_x*block, min_y*block, (max_x-min_x+1)*block, (max_y-min_y+1)*block};
+        rects.push_back(grow_rect(area, margin, width, height));
+    }
+
+    merge_rects(rects);
+    return rects;
+}
+
+/*
+    Host versions of make_luma_image, make_gradient and color_watershed
+    (ocl_source.cl), for the engines that keep the image on the host.
+    They follow the kernels to the letter, quirks included: the luma is
+    computed from the red channel only (the kernel broadcasts .x), and the
+    gradient is saturated into a uchar, negative values included.
+ */
+void make_luma_host(const BMPVEC& rgba, int width, int height, std::vector<uint8_t>& luma) {
+    luma.resize((size_t)width*height);
+    for (size_t i=0; i<luma.size(); i++) {
+        float r = (uint8_t)rgba[i*4];
+        luma[i] = (uint8_t)floorf((0.2126f * r) + (0.7152f * r) + (0.0722f * r));
+    }
+}
+
+void make_gradient_host(const std::vector<uint8_t>& luma, int width, int height, std::vector<uint8_t>& gradient) {
+    // 0 -1 0 / -1 0 1 / 0 1 0, clamped to the edges
+    gradient.resize((size_t)width*height);
+    for (int y=0; y<height; y++) {
+        int north = std::max(y-1, 0);
+        int south = std::min(y+1, height-1);
+        for (int x=0; x<width; x++) {
+            int west = std::max(x-1, 0);
+            int east = std::min(x+1, width-1);
+            int n_pixel =
+                - luma[(size_t)north*width + x]
+                - luma[(size_t)y*width + west]
+                + luma[(size_t)y*width + east]
+                + luma[(size_t)south*width + x];
+            gradient[(size_t)y*width + x] = n_pixel < 0 || n_pixel > 255 ? 255 : n_pixel;
+        }
+    }
+}
+
+void color_labels_host(const BMPVEC& rgba, int width, int height, const std::vector<uint32_t>& labels, std::vector<uint8_t>& outimage) {
+    outimage.resize((size_t)width*height*4);
+    for (size_t i=0; i<(size_t)width*height; i++) {
+        memcpy(&outimage[i*4], &rgba[(size_t)labels[i]*4], 4);
+    }
+}
+
+void rgba2rgb(unsigned char* invec, size_t size, unsigned char* outvec) {
     size *= 3;
-    int k=0;
-    for (int i=0; i<size; i+=3) {
+    size_t k=0;
+    for (size_t i=0; i<size; i+=3) {
         outvec[i] = invec[k];
         outvec[i+1] = invec[k+1];
         outvec[i+2] = invec[k+2];
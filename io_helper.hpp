@@ -1,5 +1,16 @@
 #pragma once
 
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <dirent.h>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+
 std::string get_dir(const std::string filepath) {
     std::string toret = "";
     for (int i=filepath.length(); i>=0; i--) {
@@ -15,7 +26,7 @@ std::string get_dir(const std::string filepath) {
     return toret;
 }
 
-void write_ppm(unsigned char* bytes, int size, int width, int height, std::string path, int colors=255) {
+void write_ppm(unsigned char* bytes, size_t size, int width, int height, std::string path, int colors=255) {
     std::string s = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n" + std::to_string(colors) + "\n";
     std::string bs(reinterpret_cast<char*>(bytes), size);
 
@@ -24,3 +35,102 @@ void write_ppm(unsigned char* bytes, int size, int width, int height, std::strin
     fwrite( s.c_str(), 1, s.size(), file );
     fclose(file);
 }
+
+std::string get_stem(const std::string filepath) {
+    // file name without directory and extension
+    size_t slash = filepath.find_last_of('/');
+    std::string name = slash == std::string::npos ? filepath : filepath.substr(slash+1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+std::vector<std::string> list_batch_inputs(const std::string path) {
+    // a directory (every .ppm in it, sorted) or a text file with one path per line
+    std::vector<std::string> inputs;
+    DIR* dir = opendir(path.c_str());
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            std::string name = entry->d_name;
+            if (name.length() > 4 && name.substr(name.length()-4) == ".ppm")
+                inputs.push_back(path + "/" + name);
+        }
+        closedir(dir);
+        std::sort(inputs.begin(), inputs.end());
+        return inputs;
+    }
+    std::ifstream list(path);
+    if (!list) {
+        std::cerr << TERM_RED << "Error: could not open batch input " << path << TERM_RESET << std::endl;
+        exit(1);
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        if (!line.empty() && line[0] != '#') inputs.push_back(line);
+    }
+    return inputs;
+}
+
+bool read_ppm_token(FILE* stream, std::string &token) {
+    // whitespace separated PPM header field, skipping comments
+    token.clear();
+    int c = fgetc(stream);
+    while (c != EOF && (isspace(c) || c == '#')) {
+        if (c == '#') while (c != EOF && c != '\n') c = fgetc(stream);
+        c = fgetc(stream);
+    }
+    while (c != EOF && !isspace(c)) {
+        token += (char)c;
+        c = fgetc(stream);
+    }
+    // the single whitespace after the last field was consumed with it
+    return !token.empty();
+}
+
+bool parse_ppm_size(const std::string &token, int &size) {
+    // a positive decimal that fits an int, nothing else
+    char *end = NULL;
+    errno = 0;
+    long value = strtol(token.c_str(), &end, 10);
+    if (token.empty() || *end != '\0' || errno == ERANGE || value < 1 || value > INT_MAX) return false;
+    size = (int)value;
+    return true;
+}
+
+bool read_ppm_frame(FILE* stream, std::vector<char> &buffer, int &width, int &height) {
+    // next binary PPM of a concatenated stream, false at the end of the stream
+    std::string magic, w, h, colors;
+    if (!read_ppm_token(stream, magic)) return false;
+    if (magic != "P6" ||
+        !read_ppm_token(stream, w) || !read_ppm_token(stream, h) || !read_ppm_token(stream, colors) ||
+        colors != "255" || !parse_ppm_size(w, width) || !parse_ppm_size(h, height)) {
+        std::cerr << TERM_RED << "Error: only 8 bit binary PPM (P6) frames can be streamed" << TERM_RESET << std::endl;
+        exit(1);
+    }
+    buffer.resize((size_t)width*height*3);
+    if (fread(&buffer[0], 1, buffer.size(), stream) != buffer.size()) {
+        // the header was there, so this is a cut off frame rather than the end
+        std::cerr << TERM_RED << "Error: truncated PPM frame in the input stream" << TERM_RESET << std::endl;
+        exit(1);
+    }
+    return true;
+}
+
+bool read_raw_frame(FILE* stream, std::vector<char> &buffer, int width, int height) {
+    // next rgb24 frame of a raw video stream (e.g. ffmpeg -f rawvideo -pix_fmt rgb24)
+    buffer.resize((size_t)width*height*3);
+    size_t read = fread(&buffer[0], 1, buffer.size(), stream);
+    if (read == 0) return false;
+    if (read != buffer.size()) {
+        std::cerr << TERM_RED << "Error: truncated raw frame in the input stream (" <<
+            read << " of " << buffer.size() << " bytes)" << TERM_RESET << std::endl;
+        exit(1);
+    }
+    return true;
+}
+
+void write_frame(FILE* stream, unsigned char* bytes, int width, int height, bool ppm_header) {
+    if (ppm_header) fprintf(stream, "P6\n%d %d\n255\n", width, height);
+    fwrite(bytes, 1, (size_t)width*height*3, stream);
+    fflush(stream);
+}
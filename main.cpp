@@ -3,6 +3,8 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <thread>
+#include <mutex>
 // These are for the random generation
 #include <cstdlib>
 #include <ctime>
@@ -23,197 +25,707 @@
 #include "imagelib.hpp"
 #include "io_helper.hpp"
 #include "ocl_helper.hpp"
+#include "program_cache.hpp"
+#include "frame_queue.hpp"
+#include "strips.hpp"
+#include "tiles.hpp"
+#include "cpu_backend.hpp"
+#include "flood.hpp"
+
+// ocl_source.cl as a raw string literal, generated at build time by embed_cl (see ocl_watershed.pro)
+const char* ocl_source_embedded =
+#include "ocl_source.inc"
+;
+
+/*
+    Options of a run, shared by every image of a batch
+ */
+typedef struct tagWATERSHED_OPTIONS {
+    std::string backend;
+    int threads;
+    bool cpu_simd;
+    std::string cpu_schedule;
+    bool cpu_scaling;
+    std::string automaton_memory;
+    std::string schedule;
+    std::string arrow_source;
+    int lws_cli;
+    int sync_interval;
+    int temporal_steps_cli;
+    bool packed_storage;
+    bool jit_specialize;
+    bool enable_profiling;
+    bool warm_start;
+    int warm_threshold;
+    bool dirty_rects;
+    int dirty_margin;
+    bool multidevice;
+    int exchange_interval;
+    int tile_size;
+    int uf_lookahead;
+} WATERSHED_OPTIONS;
+
+/*
+    An image on its way through the pipeline: decoded on the host,
+    uploaded, computed and downloaded on the device, encoded on the host.
+    The events chain the device stages across the three queues.
+ */
+typedef struct tagFRAME {
+    std::string in_path;
+    std::string out_path;
+    int width;
+    int height;
+    BMPVEC rgba;
+    std::vector<uint8_t> output_rgba;
+    int slot;
+    cl::Event uploaded;
+    cl::Event computed;
+    cl::Event downloaded;
+    std::chrono::high_resolution_clock::time_point start;
+} FRAME;
+
+/*
+    Input and output images of a frame in flight. With the pipeline, frame
+    N+1 is uploaded and frame N-1 downloaded while frame N computes, so
+    these are double buffered; the events say when the previous frame in
+    the slot is done with them.
+ */
+#define PIPELINE_SLOTS 2
+
+// tile size the inputs are compared in for --dirtyrects
+#define DIRTY_BLOCK 16
+typedef struct tagPIPELINE_SLOT {
+    int width;
+    int height;
+    cl::Image2D input_image;
+    cl::Image2D output_image;
+    cl::Event input_free;
+    cl::Event output_free;
+} PIPELINE_SLOT;
+
+/*
+    Device images and buffers kept across the images of a batch.
+    The images are reused only for the same size, the lattice and labels
+    buffers whenever the new image has no more pixels than they were
+    allocated for (the kernels index them with the current width).
+    The luma, gradient and automaton state are only used by the compute
+    stage, which runs one frame at a time, so they aren't double buffered.
+ */
+typedef struct tagDEVICE_POOL {
+    int width;
+    int height;
+    size_t buffer_pixels;
+    PIPELINE_SLOT slots[PIPELINE_SLOTS];
+    cl::Image2D luma_image;
+    cl::Image2D gradient_image;
+    // warm start: the previous frame's luma and gradient (swapped with the
+    // current ones every frame), and whether t1 holds its converged state
+    cl::Image2D prev_luma_image;
+    cl::Image2D prev_gradient_image;
+    // per label invalidation flags of the warm start and the dirty rectangles
+    cl::Buffer label_dirty;
+    bool warm_valid;
+    // dirty rectangles: the previous input, and whether t0 and t1 both hold its converged state
+    BMPVEC prev_rgba;
+    bool dirty_valid;
+    cl::Buffer t0_lattice;
+    cl::Buffer t1_lattice;
+    cl::Buffer t0_labels;
+    cl::Buffer t1_labels;
+    int allocations;
+    int reuses;
+} DEVICE_POOL;
+
+/*
+    Everything that outlives a single image.
+    queue runs the compute stage; without the pipeline upload_queue and
+    download_queue are the same queue.
+ */
+typedef struct tagWATERSHED_ENV {
+    cl::Device device;
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::CommandQueue upload_queue;
+    cl::CommandQueue download_queue;
+    PROGRAM_CACHE program_cache;
+    DEVICE_POOL pool;
+    // devices running the automaton with --multidevice, the coloring stays on device
+    std::vector<STRIP_DEVICE> strips;
+    // tile buffers of the tiled automaton, the rest of the frame stays on the host
+    TILED_ENGINE tiles;
+} WATERSHED_ENV;
+
+void init_device_pool(DEVICE_POOL &pool) {
+    pool.width = 0;
+    pool.height = 0;
+    pool.buffer_pixels = 0;
+    pool.warm_valid = false;
+    pool.dirty_valid = false;
+    for (int i=0; i<PIPELINE_SLOTS; i++) {
+        pool.slots[i].width = 0;
+        pool.slots[i].height = 0;
+    }
+    pool.allocations = 0;
+    pool.reuses = 0;
+}
 
-int main(int argc, const char** argv) {
-
-    std::string pwd = get_dir(argv[0]);
-
-    cxxopts::Options options("ocl_watershed", "OpenCL implementation of the watershed transform");
-    options.add_options()
-        ("p,profiling", "Enable profiling")
-        ("i,input", "Input PPM image file path",
-            cxxopts::value<std::string>())
-        ("o,output", "Output file path",
-            cxxopts::value<std::string>()->default_value(pwd + "/out.ppm"))
-        ("l,localworksize", "Local work size",
-            cxxopts::value<int>()->default_value("0"))
-        ("a,automaton", "Automaton implementation (valid values: global, local, image)\n\tglobal: use global memory\n\tlocal: use local memory\n\timage: use texture memory",
-            cxxopts::value<std::string>()->default_value("global"))
-        ("P,selectplatform", "Manually select platform in runtime",
-            cxxopts::value<int>()->default_value("0"));
-
-
+void acquire_device_pool(DEVICE_POOL &pool, cl::Context &context, int width, int height, bool lattice_buffers, bool warm_start, bool dirty_rects) {
+    cl_int err;
+    bool reused = true;
 
-    auto result = options.parse(argc, argv);
+    if (pool.width != width || pool.height != height) {
+        pool.luma_image = cl::Image2D(
+                    context,
+                    CL_MEM_READ_WRITE,
+                    cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
+                    width, height,
+                    0,
+                    NULL,
+                    &err);
+        cl_check(err, "Creating luma image");
 
-    std::string bmp_path="";
-    std::string out_path="";
+        pool.gradient_image = cl::Image2D(
+                    context,
+                    CL_MEM_READ_WRITE,
+                    cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
+                    width, height,
+                    0,
+                    NULL,
+                    &err);
+        cl_check(err, "Creating gradient image");
+
+        if (warm_start) {
+            pool.prev_luma_image = cl::Image2D(
+                        context,
+                        CL_MEM_READ_WRITE,
+                        cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
+                        width, height,
+                        0,
+                        NULL,
+                        &err);
+            cl_check(err, "Creating previous luma image");
+
+            pool.prev_gradient_image = cl::Image2D(
+                        context,
+                        CL_MEM_READ_WRITE,
+                        cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
+                        width, height,
+                        0,
+                        NULL,
+                        &err);
+            cl_check(err, "Creating previous gradient image");
+        }
 
-    if (result.count("i") == 1) {
-        bmp_path = result["i"].as<std::string>();
-    }
-    else {
-        std::cout << options.help() << std::endl;
-        exit(1);
+        pool.width = width;
+        pool.height = height;
+        pool.warm_valid = false;
+        pool.dirty_valid = false;
+        reused = false;
     }
 
-    int lws_cli = result["l"].as<int>();
-    std::string automaton_memory = result["a"].as<std::string>();
-    if (automaton_memory != "global" && automaton_memory != "local" && automaton_memory != "image") {
-        std::cout << TERM_RED <<
-            "WARNING: provided automaton implementation argument (-a, --automaton) invalid. Falling back to global" <<
-            TERM_RESET << std::endl;
-        automaton_memory = "global";
+    size_t pixels = (size_t)width*height;
+    if (pixels > pool.buffer_pixels) {
+        if (lattice_buffers) {
+            pool.t0_lattice = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*pixels);
+            pool.t1_lattice = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*pixels);
+            pool.t0_labels = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*pixels);
+        }
+        pool.t1_labels = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*pixels);
+        if (warm_start || dirty_rects) pool.label_dirty = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*pixels);
+        pool.buffer_pixels = pixels;
+        pool.warm_valid = false;
+        pool.dirty_valid = false;
+        reused = false;
     }
 
-    out_path = result["o"].as<std::string>();
-    bool enable_profiling = result.count("p");
-    int selectplatform = result["P"].as<int>();
+    if (reused) pool.reuses++;
+    else pool.allocations++;
+}
 
-    if (enable_profiling) std::cout << TERM_CYAN <<
-        "Running with profiling enabled" << TERM_RESET << std::endl;
+void acquire_pipeline_slot(DEVICE_POOL &pool, cl::Context &context, int slot_index, int width, int height) {
+    PIPELINE_SLOT &slot = pool.slots[slot_index];
+    if (slot.width == width && slot.height == height) return;
 
     cl_int err;
+    slot.input_image = cl::Image2D(
+                context,
+                CL_MEM_READ_ONLY,
+                cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
+                width, height,
+                0,
+                NULL,
+                &err);
+    cl_check(err, "Creating input image");
 
-    BMPVEC bmp;
+    slot.output_image = cl::Image2D(
+                context,
+                CL_MEM_WRITE_ONLY,
+                cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
+                width, height,
+                0,
+                NULL,
+                &err);
+    cl_check(err, "Creating output image");
+
+    // the old images are released by the runtime once the frames using them are done
+    slot.width = width;
+    slot.height = height;
+    slot.input_free = cl::Event();
+    slot.output_free = cl::Event();
+}
 
-    int bmp_width;
-    int bmp_height;
+void decode_frame(FRAME &frame) {
+    BMPVEC bmp;
 
-    read_ppm(bmp_path, bmp, bmp_width, bmp_height);
+    read_ppm(frame.in_path, bmp, frame.width, frame.height);
 
     std::cout << TERM_GREEN <<
                  "Loaded picture: " <<
-                 bmp_path << std::endl <<
+                 frame.in_path << std::endl <<
                  "    Size: " <<
-                 bmp_width << "x" << bmp_height <<
+                 frame.width << "x" << frame.height <<
                  TERM_RESET << std::endl;
 
+    bgr2bgra(bmp, frame.rgba);
+}
 
-    BMPVEC bmp_RGBA_data;
-    bgr2bgra(bmp, bmp_RGBA_data);
+void upload_frame(WATERSHED_ENV &env, FRAME &frame) {
+    PIPELINE_SLOT &slot = env.pool.slots[frame.slot];
+
+    cl::size_t<3> wi_origin;
+    wi_origin[0] = 0;
+    wi_origin[1] = 0;
+    wi_origin[2] = 0;
+    cl::size_t<3> wi_region;
+    wi_region[0] = frame.width;
+    wi_region[1] = frame.height;
+    wi_region[2] = 1;
+
+    // the previous frame in this slot must be done reading its input
+    std::vector<cl::Event> wait_events;
+    if (slot.input_free()) wait_events.push_back(slot.input_free);
+
+    cl_int err = env.upload_queue.enqueueWriteImage(
+                        slot.input_image,
+                        CL_FALSE,
+                        wi_origin,
+                        wi_region,
+                        0,
+                        0,
+                        (void*)(&frame.rgba[0]),
+                        wait_events.empty() ? NULL : &wait_events,
+                        &frame.uploaded);
+    cl_check(err, "Writing image to device");
+    env.upload_queue.flush();
+}
 
-    cl::Device default_device = ocl_get_default_device(selectplatform);
-    cl::Context context({default_device});
-    cl::Program::Sources sources;
+void download_frame(WATERSHED_ENV &env, FRAME &frame) {
+    PIPELINE_SLOT &slot = env.pool.slots[frame.slot];
 
-    cl::CommandQueue queue;
-    if (enable_profiling) queue = cl::CommandQueue(context, default_device, CL_QUEUE_PROFILING_ENABLE);
-    else queue = cl::CommandQueue(context, default_device);
+    frame.output_rgba.resize((size_t)frame.width*frame.height*4);
 
-    cl::Image2D cl_input_image =  cl::Image2D(
-                context,
-                CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
-                cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
-                bmp_width, bmp_height,
-                0,
-                (void*)(&bmp_RGBA_data[0]),
-                &err);
-    cl_check(err, "Creating input image");
+    cl::size_t<3> ri_origin;
+    ri_origin[0] = 0;
+    ri_origin[1] = 0;
+    ri_origin[2] = 0;
+    cl::size_t<3> ri_region;
+    ri_region[0] = frame.width;
+    ri_region[1] = frame.height;
+    ri_region[2] = 1;
 
-    cl::Image2D cl_luma_image = cl::Image2D(
-                context,
-                CL_MEM_READ_WRITE,
-                cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
-                bmp_width, bmp_height,
-                0,
-                NULL,
-                &err);
-    cl_check(err, "Creating luma image");
+    std::vector<cl::Event> wait_events;
+    wait_events.push_back(frame.computed);
 
-    cl::Image2D cl_gradient_image = cl::Image2D(
-                context,
-                CL_MEM_READ_WRITE,
-                cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
-                bmp_width, bmp_height,
-                0,
-                NULL,
-                &err);
-    cl_check(err, "Creating gradient image");
+    cl_int err = env.download_queue.enqueueReadImage(
+                        slot.output_image,
+                        CL_FALSE,
+                        ri_origin,
+                        ri_region,
+                        0,
+                        0,
+                        &frame.output_rgba[0],
+                        &wait_events,
+                        &frame.downloaded);
+    cl_check(err, "Reading image from device");
+    env.download_queue.flush();
 
-    cl::Image2D cl_output_image = cl::Image2D(
-                context,
-                CL_MEM_WRITE_ONLY,
-                cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
-                bmp_width, bmp_height,
-                0,
-                NULL,
-                &err);
-    cl_check(err, "Creating output image");
+    slot.output_free = frame.downloaded;
+}
+
+void encode_frame(FRAME &frame) {
+    std::vector<uint8_t> rgb_outimage((size_t)frame.width*frame.height*3);
+    rgba2rgb(
+        &frame.output_rgba[0],
+        (size_t)frame.width*frame.height,
+        &rgb_outimage[0]
+    );
 
-    cl::Buffer cl_t0_lattice(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*bmp_width*bmp_height);
-    cl::Buffer cl_t1_lattice(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*bmp_width*bmp_height);
+    write_ppm(&rgb_outimage[0],
+        3*(size_t)frame.width*frame.height,
+        frame.width,
+        frame.height,
+        frame.out_path);
+}
+
+void compute_frame(
+        WATERSHED_ENV &env,
+        const WATERSHED_OPTIONS &opts,
+        FRAME &frame) {
+
+    std::string automaton_memory = opts.automaton_memory;
+    std::string schedule = opts.schedule;
+    std::string arrow_source = opts.arrow_source;
+    int lws_cli = opts.lws_cli;
+    int sync_interval = opts.sync_interval;
+    int temporal_steps_cli = opts.temporal_steps_cli;
+    int temporal_steps = temporal_steps_cli;
+    bool packed_storage = opts.packed_storage;
+    bool jit_specialize = opts.jit_specialize;
+    bool enable_profiling = opts.enable_profiling;
+
+    cl::Device &default_device = env.device;
+    cl::Context &context = env.context;
+    cl::CommandQueue &queue = env.queue;
+    PROGRAM_CACHE &program_cache = env.program_cache;
 
-    cl::Buffer cl_t0_labels(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*bmp_width*bmp_height);
-    cl::Buffer cl_t1_labels(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*bmp_width*bmp_height);
+    cl_int err;
 
-    uint32_t* host_init_are_diff = new uint32_t();
-    host_init_are_diff[0] = 0u;
-    cl::Buffer cl_are_diff(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(cl_uint), host_init_are_diff, &err);
+    int bmp_width = frame.width;
+    int bmp_height = frame.height;
 
-    cl_check(err, "Creating are_diff value buffer");
+    // with --multidevice the strip devices hold the lattices, only the labels come back for the coloring
+    acquire_device_pool(env.pool, context, bmp_width, bmp_height,
+                        automaton_memory != "inplace" && !opts.multidevice, opts.warm_start, opts.dirty_rects);
 
-    std::string ocl_source = read_kernel(pwd + "/ocl_source.cl");
-    sources.push_back({ocl_source.c_str(), ocl_source.length()});
-    cl::Program program(context, sources);
-    if (program.build({default_device}) != CL_SUCCESS) {
-        std::cerr << TERM_RED <<
-                     "Error Building: " <<
-                     program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(default_device) <<
-                     TERM_RESET << std::endl;
-        exit(1);
+    // this frame's luma and gradient go where the frame before last had them
+    bool warm = opts.warm_start && env.pool.warm_valid;
+    if (opts.warm_start) {
+        std::swap(env.pool.luma_image, env.pool.prev_luma_image);
+        std::swap(env.pool.gradient_image, env.pool.prev_gradient_image);
+    }
+
+    PIPELINE_SLOT &slot = env.pool.slots[frame.slot];
+    cl::Image2D cl_input_image = slot.input_image;
+    cl::Image2D cl_output_image = slot.output_image;
+    cl::Image2D cl_luma_image = env.pool.luma_image;
+    cl::Image2D cl_gradient_image = env.pool.gradient_image;
+    // the in place automaton keeps its state in a single packed buffer,
+    // it only needs the t1 labels for the coloring
+    cl::Buffer cl_t0_lattice = env.pool.t0_lattice;
+    cl::Buffer cl_t1_lattice = env.pool.t1_lattice;
+    cl::Buffer cl_t0_labels = env.pool.t0_labels;
+    cl::Buffer cl_t1_labels = env.pool.t1_labels;
+
+    // Regions recomputed this frame: the whole frame, or with --dirtyrects the
+    // areas that changed since the previous input (plus a margin for the
+    // changes to propagate), grown below to the basins they touch, as long
+    // as they cover less than half the frame. Outside of them the previous
+    // luma, gradient, lattice and labels are kept.
+    std::vector<RECT> regions;
+    bool dirty_run = false;
+    if (opts.dirty_rects && env.pool.dirty_valid) {
+        regions = changed_rects(env.pool.prev_rgba, frame.rgba, bmp_width, bmp_height, 4, DIRTY_BLOCK, opts.dirty_margin);
+        size_t dirty_area = 0;
+        for (size_t i=0; i<regions.size(); i++) dirty_area += (size_t)regions[i].width*regions[i].height;
+        dirty_run = dirty_area*2 < (size_t)bmp_width*bmp_height;
+        std::cout << TERM_CYAN <<
+            "Dirty rectangles: " << regions.size() << ", " <<
+            100.0*dirty_area/((size_t)bmp_width*bmp_height) << "% of the frame" <<
+            (dirty_run ? "" : ", recomputing the whole frame") <<
+            TERM_RESET << std::endl;
+    }
+    if (!dirty_run) {
+        regions.clear();
+        regions.push_back(RECT{0, 0, bmp_width, bmp_height});
     }
 
+    // the upload may still be running on the upload queue
+    std::vector<cl::Event> uploaded_events;
+    uploaded_events.push_back(frame.uploaded);
+    // the coloring reads the input too (with no dirty rectangle nothing else
+    // waits for the upload), and the previous frame in the slot may still be
+    // downloading its output
+    std::vector<cl::Event> color_wait_events = uploaded_events;
+    if (slot.output_free()) color_wait_events.push_back(slot.output_free);
+
+    // One program per automaton: only the kernels of the selected mode get compiled.
+    // Only the local memory automata use LWS_X, and only when the local work size
+    // is known before building (otherwise it comes from the preferred multiple of a built kernel)
+    std::string build_options = mode_options(automaton_memory);
+    if (jit_specialize) build_options += " " +
+        specialization_options(bmp_width, bmp_height, automaton_memory == "local" ? lws_cli : 0);
+    cl::Program program = get_program(program_cache, context, default_device, ocl_source_embedded, build_options);
+
 #if 0
     std::cout << "Program build log:\n" <<
         program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(default_device) <<
         std::endl << std::endl;
 #endif
 
-    cl::Kernel kernel_make_luma_image = cl::Kernel(program, "make_luma_image");
-    cl::Kernel kernel_make_gradient = cl::Kernel(program, "make_gradient");
-    cl::Kernel kernel_init_t0 = cl::Kernel(program, "init_t0");
-    cl::Kernel kernel_init_t0_image = cl::Kernel(program, "init_t0_image");
-    cl::Kernel kernel_automaton = cl::Kernel(program, "automaton");
-    cl::Kernel kernel_automaton_image = cl::Kernel(program, "automaton_image");
-    cl::Kernel kernel_automaton_global = cl::Kernel(program, "automaton_global");
-    cl::Kernel kernel_color_watershed = cl::Kernel(program, "color_watershed");
-    cl::Kernel kernel_color_watershed_image = cl::Kernel(program, "color_watershed_image");
+    cl::Kernel kernel_make_luma_image = get_kernel(program_cache, program, build_options, "make_luma_image");
+    cl::Kernel kernel_make_gradient = get_kernel(program_cache, program, build_options, "make_gradient");
+    cl::Kernel kernel_color_watershed = get_kernel(program_cache, program, build_options, "color_watershed");
+    cl::Kernel kernel_color_watershed_image = get_kernel(program_cache, program, build_options, "color_watershed_image");
+
+    // the automaton kernels only exist in the program of their mode
+    cl::Kernel kernel_init_t0;
+    cl::Kernel kernel_init_t0_image;
+    cl::Kernel kernel_automaton;
+    cl::Kernel kernel_automaton_temporal;
+    cl::Kernel kernel_automaton_persistent;
+    cl::Kernel kernel_automaton_persistent_step;
+    cl::Kernel kernel_steepest_descent;
+    cl::Kernel kernel_uf_init_heights;
+    cl::Kernel kernel_uf_lookahead;
+    cl::Kernel kernel_uf_descent;
+    cl::Kernel kernel_uf_hook_plateaus;
+    cl::Kernel kernel_uf_find_exits;
+    cl::Kernel kernel_uf_link_exits;
+    cl::Kernel kernel_uf_compress;
+    cl::Kernel kernel_uf_unreached_labels;
+    cl::Kernel kernel_pointer_jump;
+    cl::Kernel kernel_init_worklist;
+    cl::Kernel kernel_automaton_frontier_update;
+    cl::Kernel kernel_automaton_frontier_commit;
+    cl::Kernel kernel_automaton_image;
+    cl::Kernel kernel_automaton_global;
+    cl::Kernel kernel_automaton_global_redblack;
+    cl::Kernel kernel_automaton_image_redblack;
+    cl::Kernel kernel_init_t0_packed;
+    cl::Kernel kernel_automaton_global_packed;
+    cl::Kernel kernel_unpack_labels;
+    cl::Kernel kernel_automaton_inplace;
+
+    if (automaton_memory == "global") {
+        kernel_init_t0 = get_kernel(program_cache, program, build_options, "init_t0");
+        kernel_automaton_global = get_kernel(program_cache, program, build_options, "automaton_global");
+        kernel_automaton_global_redblack = get_kernel(program_cache, program, build_options, "automaton_global_redblack");
+        kernel_init_t0_packed = get_kernel(program_cache, program, build_options, "init_t0_packed");
+        kernel_automaton_global_packed = get_kernel(program_cache, program, build_options, "automaton_global_packed");
+        kernel_unpack_labels = get_kernel(program_cache, program, build_options, "unpack_labels");
+    }
+    else if (automaton_memory == "local") {
+        kernel_init_t0 = get_kernel(program_cache, program, build_options, "init_t0");
+        kernel_automaton = get_kernel(program_cache, program, build_options, "automaton");
+        kernel_automaton_temporal = get_kernel(program_cache, program, build_options, "automaton_temporal");
+    }
+    else if (automaton_memory == "persistent") {
+        kernel_init_t0 = get_kernel(program_cache, program, build_options, "init_t0");
+        kernel_automaton_persistent = get_kernel(program_cache, program, build_options, "automaton_persistent");
+        kernel_automaton_persistent_step = get_kernel(program_cache, program, build_options, "automaton_persistent_step");
+    }
+    else if (automaton_memory == "unionfind") {
+        kernel_uf_init_heights = get_kernel(program_cache, program, build_options, "uf_init_heights");
+        kernel_uf_lookahead = get_kernel(program_cache, program, build_options, "uf_lookahead");
+        kernel_uf_descent = get_kernel(program_cache, program, build_options, "uf_descent");
+        kernel_uf_hook_plateaus = get_kernel(program_cache, program, build_options, "uf_hook_plateaus");
+        kernel_uf_find_exits = get_kernel(program_cache, program, build_options, "uf_find_exits");
+        kernel_uf_link_exits = get_kernel(program_cache, program, build_options, "uf_link_exits");
+        kernel_uf_compress = get_kernel(program_cache, program, build_options, "uf_compress");
+        kernel_uf_unreached_labels = get_kernel(program_cache, program, build_options, "uf_unreached_labels");
+    }
+    else if (automaton_memory == "arrows") {
+        kernel_steepest_descent = get_kernel(program_cache, program, build_options, "steepest_descent");
+        kernel_pointer_jump = get_kernel(program_cache, program, build_options, "pointer_jump");
+    }
+    else if (automaton_memory == "frontier") {
+        kernel_init_t0 = get_kernel(program_cache, program, build_options, "init_t0");
+        kernel_init_worklist = get_kernel(program_cache, program, build_options, "init_worklist");
+        kernel_automaton_frontier_update = get_kernel(program_cache, program, build_options, "automaton_frontier_update");
+        kernel_automaton_frontier_commit = get_kernel(program_cache, program, build_options, "automaton_frontier_commit");
+    }
+    else if (automaton_memory == "inplace") {
+        kernel_init_t0_packed = get_kernel(program_cache, program, build_options, "init_t0_packed");
+        kernel_automaton_inplace = get_kernel(program_cache, program, build_options, "automaton_inplace");
+        kernel_unpack_labels = get_kernel(program_cache, program, build_options, "unpack_labels");
+    }
+    else if (automaton_memory == "image") {
+        kernel_init_t0_image = get_kernel(program_cache, program, build_options, "init_t0_image");
+        kernel_automaton_image = get_kernel(program_cache, program, build_options, "automaton_image");
+        kernel_automaton_image_redblack = get_kernel(program_cache, program, build_options, "automaton_image_redblack");
+    }
+    cl::Kernel kernel_warm_mark_changed;
+    cl::Kernel kernel_warm_init_t0;
+    cl::Kernel kernel_dirty_mark_labels;
+    cl::Kernel kernel_dirty_basin_bounds;
+    if (opts.warm_start) {
+        kernel_warm_mark_changed = get_kernel(program_cache, program, build_options, "warm_mark_changed");
+    }
+    if (opts.warm_start || dirty_run) {
+        kernel_warm_init_t0 = get_kernel(program_cache, program, build_options, "warm_init_t0");
+    }
+    if (dirty_run) {
+        kernel_dirty_mark_labels = get_kernel(program_cache, program, build_options, "dirty_mark_labels");
+        kernel_dirty_basin_bounds = get_kernel(program_cache, program, build_options, "dirty_basin_bounds");
+    }
+
+    // with --multidevice every strip device makes the luma and gradient of
+    // its own strip, only the upload and the coloring run on this device
+    if (!opts.multidevice) {
+        kernel_make_luma_image.setArg(0, cl_input_image);
+        kernel_make_luma_image.setArg(1, cl_luma_image);
+
+        for (size_t i=0; i<regions.size(); i++) {
+            // the gradient of the region reads one pixel around it
+            RECT luma_region = dirty_run ? grow_rect(regions[i], 1, bmp_width, bmp_height) : regions[i];
+            queue.enqueueNDRangeKernel(
+                    kernel_make_luma_image,
+                    cl::NDRange(luma_region.x, luma_region.y),
+                    cl::NDRange(luma_region.width, luma_region.height),
+                    cl::NullRange,
+                    &uploaded_events);
+        }
 
-    kernel_make_luma_image.setArg(0, cl_input_image);
-    kernel_make_luma_image.setArg(1, cl_luma_image);
 
-    queue.enqueueNDRangeKernel(
-            kernel_make_luma_image,
-            cl::NullRange,
-            cl::NDRange(bmp_width, bmp_height),
-            cl::NullRange);
+        //queue.finish();
+        kernel_make_gradient.setArg(0, cl_luma_image);
+        kernel_make_gradient.setArg(1, cl_gradient_image);
 
+        for (size_t i=0; i<regions.size(); i++) {
+            queue.enqueueNDRangeKernel(
+                    kernel_make_gradient,
+                    cl::NDRange(regions[i].x, regions[i].y),
+                    cl::NDRange(regions[i].width, regions[i].height),
+                    cl::NullRange);
+        }
+    }
 
     //queue.finish();
-    kernel_make_gradient.setArg(0, cl_luma_image);
-    kernel_make_gradient.setArg(1, cl_gradient_image);
 
-    queue.enqueueNDRangeKernel(
-            kernel_make_gradient,
-            cl::NullRange,
-            cl::NDRange(bmp_width, bmp_height),
-            cl::NullRange);
+    if (dirty_run) {
+        // A basin touching a changed area can hold costs that went through
+        // it, or a dead seed's label, anywhere: grow the regions to cover
+        // every such basin whole, so that none of it is kept outside
+        err = queue.enqueueFillBuffer(env.pool.label_dirty, (cl_uint)0, 0, sizeof(cl_uint)*bmp_width*bmp_height);
+        cl_check(err, "Resetting dirty labels");
+
+        kernel_dirty_mark_labels.setArg(0, cl_t1_labels);
+        kernel_dirty_mark_labels.setArg(1, bmp_width);
+        kernel_dirty_mark_labels.setArg(3, env.pool.label_dirty);
+        std::vector<cl_int> bounds(4*regions.size());
+        for (size_t i=0; i<regions.size(); i++) {
+            kernel_dirty_mark_labels.setArg(2, (cl_uint)i);
+            err = queue.enqueueNDRangeKernel(
+                        kernel_dirty_mark_labels,
+                        cl::NDRange(regions[i].x, regions[i].y),
+                        cl::NDRange(regions[i].width, regions[i].height),
+                        cl::NullRange);
+            cl_check(err, "Marking dirty basins");
+            bounds[4*i] = regions[i].x;
+            bounds[4*i+1] = regions[i].y;
+            bounds[4*i+2] = regions[i].x+regions[i].width;
+            bounds[4*i+3] = regions[i].y+regions[i].height;
+        }
+
+        cl::Buffer cl_bounds(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_int)*bounds.size(), &bounds[0], &err);
+        cl_check(err, "Creating dirty bounds buffer");
+        kernel_dirty_basin_bounds.setArg(0, cl_t1_labels);
+        kernel_dirty_basin_bounds.setArg(1, bmp_width);
+        kernel_dirty_basin_bounds.setArg(2, bmp_height);
+        kernel_dirty_basin_bounds.setArg(3, env.pool.label_dirty);
+        kernel_dirty_basin_bounds.setArg(4, cl_bounds);
+        err = queue.enqueueNDRangeKernel(
+                    kernel_dirty_basin_bounds,
+                    cl::NullRange,
+                    cl::NDRange(bmp_width, bmp_height),
+                    cl::NullRange);
+        cl_check(err, "Bounding dirty basins");
+        err = queue.enqueueReadBuffer(cl_bounds, CL_TRUE, 0, sizeof(cl_int)*bounds.size(), &bounds[0]);
+        cl_check(err, "Reading dirty bounds");
 
-    //queue.finish();
+        size_t dirty_area = 0;
+        for (size_t i=0; i<regions.size(); i++) {
+            regions[i] = RECT{bounds[4*i], bounds[4*i+1], bounds[4*i+2]-bounds[4*i], bounds[4*i+3]-bounds[4*i+1]};
+        }
+        merge_rects(regions);
+        for (size_t i=0; i<regions.size(); i++) dirty_area += (size_t)regions[i].width*regions[i].height;
+        // the luma and gradient outside of the changed areas are still valid, so is a full recompute
+        dirty_run = dirty_area*2 < (size_t)bmp_width*bmp_height;
+        std::cout << TERM_CYAN <<
+            "Dirty rectangles grown to their basins: " << regions.size() << ", " <<
+            100.0*dirty_area/((size_t)bmp_width*bmp_height) << "% of the frame" <<
+            (dirty_run ? "" : ", recomputing the whole frame") <<
+            TERM_RESET << std::endl;
+        if (!dirty_run) {
+            regions.clear();
+            regions.push_back(RECT{0, 0, bmp_width, bmp_height});
+        }
+    }
 
-    if (automaton_memory == "global" || automaton_memory == "local") {
+    // every automaton but the texture one works on the lattice and labels buffers
+    bool automaton_buffers = automaton_memory != "image";
 
-        kernel_init_t0.setArg(0, cl_t0_lattice);
-        kernel_init_t0.setArg(1, cl_t0_labels);
-        kernel_init_t0.setArg(2, bmp_width);
-        kernel_init_t0.setArg(3, cl_gradient_image);
+    if (warm) {
+        // t1 still holds the previous frame's converged lattice and labels
+        err = queue.enqueueFillBuffer(env.pool.label_dirty, (cl_uint)0, 0, sizeof(cl_uint)*bmp_width*bmp_height);
+        cl_check(err, "Resetting dirty labels");
 
-        queue.enqueueNDRangeKernel(
-                    kernel_init_t0,
+        kernel_warm_mark_changed.setArg(0, cl_luma_image);
+        kernel_warm_mark_changed.setArg(1, env.pool.prev_luma_image);
+        kernel_warm_mark_changed.setArg(2, cl_gradient_image);
+        kernel_warm_mark_changed.setArg(3, env.pool.prev_gradient_image);
+        kernel_warm_mark_changed.setArg(4, bmp_width);
+        kernel_warm_mark_changed.setArg(5, cl_t1_labels);
+        kernel_warm_mark_changed.setArg(6, (cl_uint)opts.warm_threshold);
+        kernel_warm_mark_changed.setArg(7, env.pool.label_dirty);
+
+        err = queue.enqueueNDRangeKernel(
+                    kernel_warm_mark_changed,
+                    cl::NullRange,
+                    cl::NDRange(bmp_width, bmp_height),
+                    cl::NullRange);
+        cl_check(err, "Marking changed basins");
+
+        kernel_warm_init_t0.setArg(0, cl_t1_lattice);
+        kernel_warm_init_t0.setArg(1, cl_t1_labels);
+        kernel_warm_init_t0.setArg(2, env.pool.label_dirty);
+        kernel_warm_init_t0.setArg(3, bmp_width);
+        kernel_warm_init_t0.setArg(4, cl_gradient_image);
+        kernel_warm_init_t0.setArg(5, cl_t0_lattice);
+        kernel_warm_init_t0.setArg(6, cl_t0_labels);
+
+        err = queue.enqueueNDRangeKernel(
+                    kernel_warm_init_t0,
                     cl::NullRange,
                     cl::NDRange(bmp_width, bmp_height),
                     cl::NullRange);
+        cl_check(err, "Warm starting the lattice");
+
+        queue.finish();
+
+        std::cout << TERM_CYAN <<
+            "Warm start from the previous frame" <<
+            TERM_RESET << std::endl;
+    }
+    else if (automaton_buffers && automaton_memory != "unionfind" && automaton_memory != "arrows" &&
+        automaton_memory != "inplace" && !packed_storage && !opts.multidevice) {
+
+        // in the dirty regions only the marked basins (and the seeds) start over
+        cl::Kernel &kernel_init = dirty_run ? kernel_warm_init_t0 : kernel_init_t0;
+        if (dirty_run) {
+            kernel_warm_init_t0.setArg(0, cl_t1_lattice);
+            kernel_warm_init_t0.setArg(1, cl_t1_labels);
+            kernel_warm_init_t0.setArg(2, env.pool.label_dirty);
+            kernel_warm_init_t0.setArg(3, bmp_width);
+            kernel_warm_init_t0.setArg(4, cl_gradient_image);
+            kernel_warm_init_t0.setArg(5, cl_t0_lattice);
+            kernel_warm_init_t0.setArg(6, cl_t0_labels);
+        }
+        else {
+            kernel_init_t0.setArg(0, cl_t0_lattice);
+            kernel_init_t0.setArg(1, cl_t0_labels);
+            kernel_init_t0.setArg(2, bmp_width);
+            kernel_init_t0.setArg(3, cl_gradient_image);
+        }
+
+        for (size_t i=0; i<regions.size(); i++) {
+            err = queue.enqueueNDRangeKernel(
+                        kernel_init,
+                        cl::NDRange(regions[i].x, regions[i].y),
+                        cl::NDRange(regions[i].width, regions[i].height),
+                        cl::NullRange);
+            cl_check(err, "Initializing the lattice");
+        }
 
         queue.finish();
 
@@ -225,13 +737,13 @@ int main(int argc, const char** argv) {
     cl_int gmem_lws;
     
     // Preferred Group Size Multiple
-    cl_int pref_gs_mult = kernel_automaton.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
+    cl_int pref_gs_mult = kernel_make_luma_image.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
             default_device,
             &err);
     cl_check(err, "Getting preferred group size multiple");
 
 
-    if (automaton_memory == "global" || automaton_memory == "image") {
+    if (automaton_memory == "global" || automaton_memory == "image" || automaton_memory == "inplace") {
 
         if (lws_cli) {
            
@@ -255,168 +767,885 @@ int main(int argc, const char** argv) {
     }
 
 
-    if (automaton_memory == "global") {
+    if (opts.multidevice) {
+
+        auto strips_start = std::chrono::high_resolution_clock::now();
+        std::vector<cl_uint> host_labels;
+        int rounds = run_strips(
+                    env.strips,
+                    ocl_source_embedded,
+                    frame.rgba,
+                    bmp_width,
+                    bmp_height,
+                    opts.exchange_interval,
+                    jit_specialize,
+                    host_labels);
+        double strips_time = std::chrono::duration<double>(
+            std::chrono::high_resolution_clock::now() - strips_start).count();
+
+        err = queue.enqueueWriteBuffer(cl_t1_labels, CL_TRUE, 0, sizeof(cl_uint)*bmp_width*bmp_height, &host_labels[0]);
+        cl_check(err, "Writing strip labels to device");
+
+        std::cout << TERM_CYAN <<
+            "Multi-device: " << active_strips(env.strips, bmp_height) << " devices, " <<
+            rounds << " exchange rounds of " << opts.exchange_interval << " steps, " <<
+            strips_time*1000 << " ms" <<
+            TERM_RESET << std::endl;
+        print_strips(env.strips);
+
+    }
+    else if (dirty_run) {
+
+        // A converged Jacobi run leaves t0 equal to t1, so outside of the
+        // regions both already hold the previous state and the regions only
+        // read it as their boundary.
+        int max_steps = 0;
+        for (size_t i=0; i<regions.size(); i++)
+            max_steps = std::max(max_steps, std::max(regions[i].width, regions[i].height)+1);
 
         kernel_automaton_global.setArg(0, cl_luma_image);
         kernel_automaton_global.setArg(1, bmp_width);
         kernel_automaton_global.setArg(2, bmp_height);
-        kernel_automaton_global.setArg(7, cl_are_diff);
-
-        double total_time = 0;
-        int automaton_iterations = 0;
 
-        for (int i=0; i<=std::max(bmp_width, bmp_height); i++) {
+        AUTOMATON_STATS stats = run_automaton_loop(
+                    context,
+                    queue,
+                    max_steps,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
             kernel_automaton_global.setArg(3, cl_t0_lattice);
             kernel_automaton_global.setArg(4, cl_t0_labels);
             kernel_automaton_global.setArg(5, cl_t1_lattice);
             kernel_automaton_global.setArg(6, cl_t1_labels);
+            kernel_automaton_global.setArg(7, are_diff);
 
-            host_init_are_diff[0] = 0;
-            queue.enqueueWriteBuffer(cl_are_diff, CL_TRUE, 0, sizeof(cl_uint), host_init_are_diff);
-            queue.finish();
-
-            // Insert profiling here
-            if (enable_profiling) {
-                total_time += profile_kernel(
+            for (size_t i=0; i<regions.size(); i++) {
+                enqueue_kernel(
                             queue,
                             kernel_automaton_global,
+                            cl::NDRange(regions[i].x, regions[i].y),
+                            cl::NDRange(regions[i].width, regions[i].height),
                             cl::NullRange,
-                            cl::NDRange(gmem_gws_width, gmem_gws_height),
-                            gmem_local_ndrange,
-                            "Step " + std::to_string(i) + ": ");
-                automaton_iterations++;
-            }
-            else {
-                queue.enqueueNDRangeKernel(
-                            kernel_automaton_global,
-                            cl::NullRange,
-                            cl::NDRange(gmem_gws_width, gmem_gws_height),
-                            gmem_local_ndrange);
-                queue.finish();
+                            events,
+                            "Running automaton kernel on dirty rectangle");
             }
 
-            queue.enqueueReadBuffer(cl_are_diff, CL_TRUE, 0, sizeof(uint32_t), host_init_are_diff);
-            queue.finish();
+            std::swap(cl_t0_labels, cl_t1_labels);
+            std::swap(cl_t0_lattice, cl_t1_lattice);
+            return 1;
+        });
+
+        // Every cost kept outside of the regions is still an upper bound of
+        // the new one, so a few steps over the whole frame carry the
+        // improvements that left a region and converge to the full
+        // recompute's costs; its labels may only differ at equal cost ties,
+        // as with the warm start.
+        AUTOMATON_STATS frame_stats = run_automaton_loop(
+                    context,
+                    queue,
+                    std::max(bmp_width, bmp_height)+1,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+            kernel_automaton_global.setArg(3, cl_t0_lattice);
+            kernel_automaton_global.setArg(4, cl_t0_labels);
+            kernel_automaton_global.setArg(5, cl_t1_lattice);
+            kernel_automaton_global.setArg(6, cl_t1_labels);
+            kernel_automaton_global.setArg(7, are_diff);
 
-            if (!host_init_are_diff[0])  {
-                std::cout << TERM_CYAN <<
-                    "Baling out early from automaton loop at step #" << i <<
-                    std::endl << TERM_RESET;
-                break;
-            }
+            enqueue_kernel(
+                        queue,
+                        kernel_automaton_global,
+                        cl::NullRange,
+                        cl::NDRange(gmem_gws_width, gmem_gws_height),
+                        gmem_local_ndrange,
+                        events,
+                        "Running automaton kernel after dirty rectangles");
 
             std::swap(cl_t0_labels, cl_t1_labels);
             std::swap(cl_t0_lattice, cl_t1_lattice);
-        }
+            return 1;
+        });
+
+        // the last step wrote into the t0 buffers before being swapped, bring them back to t1
+        std::swap(cl_t0_labels, cl_t1_labels);
+        std::swap(cl_t0_lattice, cl_t1_lattice);
 
         if (enable_profiling) {
-            std::cout << TERM_GREEN << "Total automaton time: " <<
-                std::setprecision(5) <<
-                total_time << "ms" << std::endl <<
-                "Mean automaton time: " <<
-                total_time/(double)automaton_iterations << "ms" <<
+            print_automaton_stats(stats, sync_interval);
+            std::cout << TERM_GREEN << "Whole frame steps after the dirty rectangles: " <<
+                frame_stats.steps << ", " << frame_stats.kernel_time << " ms" <<
                 TERM_RESET << std::endl;
-            get_memory_throughput_global(bmp_width, bmp_height, total_time);
         }
 
         queue.finish();
 
     }
-    else if (automaton_memory == "local") {
+    else if (automaton_memory == "global" && packed_storage) {
 
-        // Preferred Group Size Multiple
-        cl_int pref_gs_mult = kernel_automaton.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
-                default_device,
-                &err);
-        cl_check(err, "Getting preferred group size multiple");
+        cl::Buffer cl_t0_packed(context, CL_MEM_READ_WRITE, sizeof(cl_uint2)*bmp_width*bmp_height);
+        cl::Buffer cl_t1_packed(context, CL_MEM_READ_WRITE, sizeof(cl_uint2)*bmp_width*bmp_height);
 
-        cl_int lws = lws_cli ? lws_cli : pref_gs_mult;
+        kernel_init_t0_packed.setArg(0, cl_t0_packed);
+        kernel_init_t0_packed.setArg(1, bmp_width);
+        kernel_init_t0_packed.setArg(2, cl_gradient_image);
 
-        cl_int gws_width = round_up(bmp_width, lws);
-        cl_int gws_height = round_up(bmp_height, lws);
+        queue.enqueueNDRangeKernel(
+                    kernel_init_t0_packed,
+                    cl::NullRange,
+                    cl::NDRange(bmp_width, bmp_height),
+                    cl::NullRange);
 
-#if DEBUG
-        std::cout << "Preferred Group Size Multiple: " <<
-            pref_gs_mult << std::endl;
-        std::cout << "bmp size: " << bmp_width << "x" << bmp_height << std::endl <<
-            "gws: " << gws_width << "x" << gws_height << std::endl;
-#endif
+        kernel_automaton_global_packed.setArg(0, cl_luma_image);
+        kernel_automaton_global_packed.setArg(1, bmp_width);
+        kernel_automaton_global_packed.setArg(2, bmp_height);
 
-        kernel_automaton.setArg(0, cl_luma_image);
-        kernel_automaton.setArg(1, bmp_width);
-        kernel_automaton.setArg(2, bmp_height);
-        kernel_automaton.setArg(7, cl_are_diff);
-        kernel_automaton.setArg(8, cl::Local(
-                    sizeof(cl_uint) * ( (lws+2) * (lws+2) )
-        ));
-        kernel_automaton.setArg(9, cl::Local(
-                    sizeof(cl_uint) * ( (lws+2) * (lws+2) )
-        ));
+        AUTOMATON_STATS stats = run_automaton_loop(
+                    context,
+                    queue,
+                    std::max(bmp_width, bmp_height)+1,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+            kernel_automaton_global_packed.setArg(3, cl_t0_packed);
+            kernel_automaton_global_packed.setArg(4, cl_t1_packed);
+            kernel_automaton_global_packed.setArg(5, are_diff);
+
+            enqueue_kernel(
+                        queue,
+                        kernel_automaton_global_packed,
+                        cl::NullRange,
+                        cl::NDRange(gmem_gws_width, gmem_gws_height),
+                        gmem_local_ndrange,
+                        events,
+                        "Running automaton kernel");
 
-        /*  Graphical explanation of the cache size
-            /xxx/       0s are the core of the cache
-            x000x       xs are the workgroup neighbors
-            x000x       /s are unused memory areas that are necessary for 2d cache mapping
-            x000x
-            /xxx/
-         */
+            std::swap(cl_t0_packed, cl_t1_packed);
+            return 1;
+        });
 
-        double total_time = 0;
-        int automaton_iterations = 0;
+        // the last step wrote into t0 before being swapped: unpack its labels for the coloring
+        kernel_unpack_labels.setArg(0, cl_t0_packed);
+        kernel_unpack_labels.setArg(1, bmp_width);
+        kernel_unpack_labels.setArg(2, cl_t1_labels);
 
-        for (int i=0; i<=std::max(bmp_width, bmp_height); i++) {
-            kernel_automaton.setArg(3, cl_t0_lattice);
-            kernel_automaton.setArg(4, cl_t0_labels);
-            kernel_automaton.setArg(5, cl_t1_lattice);
-            kernel_automaton.setArg(6, cl_t1_labels);
+        err = queue.enqueueNDRangeKernel(
+                    kernel_unpack_labels,
+                    cl::NullRange,
+                    cl::NDRange(bmp_width, bmp_height),
+                    cl::NullRange);
+        cl_check(err, "Unpacking labels");
 
-            host_init_are_diff[0] = 0;
-            queue.enqueueWriteBuffer(cl_are_diff, CL_TRUE, 0, sizeof(cl_uint), host_init_are_diff);
-            queue.finish();
+        if (enable_profiling) {
+            print_automaton_stats(stats, sync_interval);
+            get_memory_throughput_global(bmp_width, bmp_height, stats.kernel_time, true, 6*8);
+        }
 
-            // Insert profiling here
-            if (enable_profiling) {
-                total_time += profile_kernel(
-                            queue,
-                            kernel_automaton,
+        queue.finish();
+
+    }
+    else if (automaton_memory == "global" && schedule == "redblack") {
+
+        // only every other pixel of each row is launched
+        cl_int rb_gws_width = round_up((bmp_width+1)/2, lws_cli ? lws_cli : pref_gs_mult);
+
+        kernel_automaton_global_redblack.setArg(0, cl_luma_image);
+        kernel_automaton_global_redblack.setArg(1, bmp_width);
+        kernel_automaton_global_redblack.setArg(2, bmp_height);
+        kernel_automaton_global_redblack.setArg(3, cl_t0_lattice);
+        kernel_automaton_global_redblack.setArg(4, cl_t0_labels);
+
+        // a step is a whole sweep, both half steps set the same flag
+        AUTOMATON_STATS stats = run_automaton_loop(
+                    context,
+                    queue,
+                    (std::max(bmp_width, bmp_height) + 2) / 2,
+                    sync_interval,
+                    2,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+            kernel_automaton_global_redblack.setArg(5, are_diff);
+            for (int color=0; color<2; color++) {
+                kernel_automaton_global_redblack.setArg(6, color);
+                enqueue_kernel(
+                            queue,
+                            kernel_automaton_global_redblack,
                             cl::NullRange,
-                            cl::NDRange(gws_width, gws_height),
-                            cl::NDRange(lws, lws),
-                            "Step " + std::to_string(i) + ": ");
-                automaton_iterations++;
+                            cl::NDRange(rb_gws_width, gmem_gws_height),
+                            gmem_local_ndrange,
+                            events,
+                            "Running red-black automaton kernel");
             }
-            else {
-                err = queue.enqueueNDRangeKernel(
-                            kernel_automaton,
-                            cl::NullRange,
-                            cl::NDRange(gws_width, gws_height),
-                            cl::NDRange(lws, lws));
-                queue.finish();
-                cl_check(err, "Running automaton kernel (step #"+std::to_string(i)+")");
+            return 2;
+        });
+
+        // the automaton works in place on the t0 buffers
+        std::swap(cl_t0_labels, cl_t1_labels);
+        std::swap(cl_t0_lattice, cl_t1_lattice);
+
+        if (enable_profiling) {
+            print_automaton_stats(stats, sync_interval);
+            std::cout << TERM_GREEN << "Sweeps: " << stats.steps <<
+                ", half steps: " << stats.launches <<
+                TERM_RESET << std::endl;
+            get_memory_throughput_global(bmp_width, bmp_height, stats.kernel_time);
+        }
+
+        queue.finish();
+
+    }
+    else if (automaton_memory == "global") {
+
+        kernel_automaton_global.setArg(0, cl_luma_image);
+        kernel_automaton_global.setArg(1, bmp_width);
+        kernel_automaton_global.setArg(2, bmp_height);
+
+        AUTOMATON_STATS stats = run_automaton_loop(
+                    context,
+                    queue,
+                    std::max(bmp_width, bmp_height)+1,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+            kernel_automaton_global.setArg(3, cl_t0_lattice);
+            kernel_automaton_global.setArg(4, cl_t0_labels);
+            kernel_automaton_global.setArg(5, cl_t1_lattice);
+            kernel_automaton_global.setArg(6, cl_t1_labels);
+            kernel_automaton_global.setArg(7, are_diff);
+
+            enqueue_kernel(
+                        queue,
+                        kernel_automaton_global,
+                        cl::NullRange,
+                        cl::NDRange(gmem_gws_width, gmem_gws_height),
+                        gmem_local_ndrange,
+                        events,
+                        "Running automaton kernel");
+
+            std::swap(cl_t0_labels, cl_t1_labels);
+            std::swap(cl_t0_lattice, cl_t1_lattice);
+            return 1;
+        });
+
+        // the last step wrote into the t0 buffers before being swapped, bring them back to t1
+        std::swap(cl_t0_labels, cl_t1_labels);
+        std::swap(cl_t0_lattice, cl_t1_lattice);
+
+        if (enable_profiling) {
+            print_automaton_stats(stats, sync_interval);
+            get_memory_throughput_global(bmp_width, bmp_height, stats.kernel_time);
+        }
+
+        queue.finish();
+
+    }
+    else if (automaton_memory == "local") {
+
+        // Preferred Group Size Multiple
+        cl_int pref_gs_mult = kernel_automaton.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
+                default_device,
+                &err);
+        cl_check(err, "Getting preferred group size multiple");
+
+        cl_int lws = lws_cli ? lws_cli : pref_gs_mult;
+
+        cl_int gws_width = round_up(bmp_width, lws);
+        cl_int gws_height = round_up(bmp_height, lws);
+
+#if DEBUG
+        std::cout << "Preferred Group Size Multiple: " <<
+            pref_gs_mult << std::endl;
+        std::cout << "bmp size: " << bmp_width << "x" << bmp_height << std::endl <<
+            "gws: " << gws_width << "x" << gws_height << std::endl;
+#endif
+
+        kernel_automaton.setArg(0, cl_luma_image);
+        kernel_automaton.setArg(1, bmp_width);
+        kernel_automaton.setArg(2, bmp_height);
+        kernel_automaton.setArg(8, cl::Local(
+                    sizeof(cl_uint) * ( (lws+2) * (lws+2) )
+        ));
+        kernel_automaton.setArg(9, cl::Local(
+                    sizeof(cl_uint) * ( (lws+2) * (lws+2) )
+        ));
+
+        /*  Graphical explanation of the cache size
+            /xxx/       0s are the core of the cache
+            x000x       xs are the workgroup neighbors
+            x000x       /s are unused memory areas that are necessary for 2d cache mapping
+            x000x
+            /xxx/
+         */
+
+        // Per work group changed flags (previous and current step), so that
+        // tiles whose neighborhood has settled skip the step altogether.
+        // Every tile has to run the first step
+        int tile_count = (gws_width/lws) * (gws_height/lws);
+        cl::Buffer cl_prev_tile_changed(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*tile_count);
+        cl::Buffer cl_tile_changed(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*tile_count);
+        err = queue.enqueueFillBuffer(cl_prev_tile_changed, (cl_uint)1, 0, sizeof(cl_uint)*tile_count);
+        cl_check(err, "Resetting tile changed flags");
+
+        cl::Kernel kernel_local_automaton = kernel_automaton;
+
+        if (temporal_steps > 1) {
+            cl_ulong local_mem_size = default_device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+            while (temporal_steps > 1 && temporal_cache_size(lws, temporal_steps) > local_mem_size) {
+                temporal_steps--;
             }
+            if (temporal_steps != temporal_steps_cli) {
+                std::cout << TERM_RED <<
+                    "WARNING: temporal blocking cache doesn't fit in local memory (" << local_mem_size <<
+                    " bytes). Falling back to " << temporal_steps << " steps per launch" <<
+                    TERM_RESET << std::endl;
+            }
+        }
+
+        if (temporal_steps > 1) {
+            /*  Same layout as above, with a halo as wide as the steps per launch
+                (2 in this case). The lattice and labels caches are doubled
+                for the ping pong between relaxation steps
+                //xxx//
+                //xxx//
+                xx000xx
+                xx000xx
+                xx000xx
+                //xxx//
+                //xxx//
+             */
+            size_t cache_cells = (lws+2*temporal_steps) * (lws+2*temporal_steps);
+            kernel_automaton_temporal.setArg(0, cl_luma_image);
+            kernel_automaton_temporal.setArg(1, bmp_width);
+            kernel_automaton_temporal.setArg(2, bmp_height);
+            kernel_automaton_temporal.setArg(8, cl::Local(sizeof(cl_uint) * 2 * cache_cells));
+            kernel_automaton_temporal.setArg(9, cl::Local(sizeof(cl_uint) * 2 * cache_cells));
+            kernel_automaton_temporal.setArg(10, cl::Local(sizeof(cl_uint) * cache_cells));
+            kernel_automaton_temporal.setArg(11, temporal_steps);
+            kernel_local_automaton = kernel_automaton_temporal;
+            std::cout << TERM_CYAN <<
+                "Temporal blocking: " << temporal_steps << " relaxation steps per launch" <<
+                TERM_RESET << std::endl;
+        }
+
+        AUTOMATON_STATS stats = run_automaton_loop(
+                    context,
+                    queue,
+                    (std::max(bmp_width, bmp_height) + temporal_steps) / temporal_steps,
+                    sync_interval,
+                    temporal_steps,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+            kernel_local_automaton.setArg(3, cl_t0_lattice);
+            kernel_local_automaton.setArg(4, cl_t0_labels);
+            kernel_local_automaton.setArg(5, cl_t1_lattice);
+            kernel_local_automaton.setArg(6, cl_t1_labels);
+            kernel_local_automaton.setArg(7, are_diff);
+            if (temporal_steps == 1) {
+                kernel_local_automaton.setArg(10, cl_prev_tile_changed);
+                kernel_local_automaton.setArg(11, cl_tile_changed);
+            }
+
+            enqueue_kernel(
+                        queue,
+                        kernel_local_automaton,
+                        cl::NullRange,
+                        cl::NDRange(gws_width, gws_height),
+                        cl::NDRange(lws, lws),
+                        events,
+                        "Running automaton kernel");
+
+            std::swap(cl_prev_tile_changed, cl_tile_changed);
+
+            std::swap(cl_t0_labels, cl_t1_labels);
+            std::swap(cl_t0_lattice, cl_t1_lattice);
+            return 1;
+        });
+
+        // the last step wrote into the t0 buffers before being swapped, bring them back to t1
+        std::swap(cl_t0_labels, cl_t1_labels);
+        std::swap(cl_t0_lattice, cl_t1_lattice);
+
+        if (enable_profiling) {
+            print_automaton_stats(stats, sync_interval);
+            get_memory_throughput_global(bmp_width, bmp_height, stats.kernel_time, lws);
+        }
+
+        queue.finish();
+
+    }
+    else if (automaton_memory == "persistent") {
+
+        // At most one work group per compute unit, and never more than there
+        // are tiles: the device side global barrier needs the groups to all be
+        // resident at the same time (it times out otherwise, see below)
+        cl_uint compute_units = default_device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        size_t max_lws = kernel_automaton_persistent.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(
+                default_device,
+                &err);
+        cl_check(err, "Getting kernel work group size");
+
+        cl_int lws = lws_cli ? std::min((size_t)lws_cli, max_lws) : max_lws;
+        cl_int groups = std::min((size_t)compute_units, ((size_t)bmp_width*bmp_height + lws-1)/lws);
+        int max_steps = std::max(bmp_width, bmp_height)+1;
 
-            queue.enqueueReadBuffer(cl_are_diff, CL_TRUE, 0, sizeof(uint32_t), host_init_are_diff);
+#if DEBUG
+        std::cout << "Compute units: " << compute_units << std::endl <<
+            "lws: " << lws << std::endl <<
+            "gws: " << groups*lws << std::endl;
+#endif
+
+        // the initial lattice, to start over from if the global barrier times out
+        size_t lattice_bytes = sizeof(cl_uint)*bmp_width*bmp_height;
+        cl::Buffer cl_initial_lattice(context, CL_MEM_READ_WRITE, lattice_bytes, NULL, &err);
+        cl_check(err, "Creating persistent automaton initial lattice buffer");
+        cl::Buffer cl_initial_labels(context, CL_MEM_READ_WRITE, lattice_bytes, NULL, &err);
+        cl_check(err, "Creating persistent automaton initial labels buffer");
+        err = queue.enqueueCopyBuffer(cl_t0_lattice, cl_initial_lattice, 0, 0, lattice_bytes);
+        cl_check(err, "Saving the initial lattice");
+        err = queue.enqueueCopyBuffer(cl_t0_labels, cl_initial_labels, 0, 0, lattice_bytes);
+        cl_check(err, "Saving the initial labels");
+
+        // barrier counter, barrier generation, changed flags (even/odd steps), steps executed, abort flag
+        cl_uint host_sync[6] = {0, 0, 0, 0, 0, 0};
+        cl::Buffer cl_sync(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(host_sync), host_sync, &err);
+        cl_check(err, "Creating persistent automaton sync buffer");
+
+        kernel_automaton_persistent.setArg(0, cl_luma_image);
+        kernel_automaton_persistent.setArg(1, bmp_width);
+        kernel_automaton_persistent.setArg(2, bmp_height);
+        kernel_automaton_persistent.setArg(3, cl_t0_lattice);
+        kernel_automaton_persistent.setArg(4, cl_t0_labels);
+        kernel_automaton_persistent.setArg(5, cl_t1_lattice);
+        kernel_automaton_persistent.setArg(6, cl_t1_labels);
+        kernel_automaton_persistent.setArg(7, cl_sync);
+        kernel_automaton_persistent.setArg(8, max_steps);
+
+        double total_time;
+        if (enable_profiling) {
+            total_time = profile_kernel(
+                        queue,
+                        kernel_automaton_persistent,
+                        cl::NullRange,
+                        cl::NDRange(groups*lws),
+                        cl::NDRange(lws),
+                        "Persistent automaton: ");
+        }
+        else {
+            err = queue.enqueueNDRangeKernel(
+                        kernel_automaton_persistent,
+                        cl::NullRange,
+                        cl::NDRange(groups*lws),
+                        cl::NDRange(lws));
             queue.finish();
+            cl_check(err, "Running persistent automaton kernel");
+        }
 
-            if (!host_init_are_diff[0])  {
+        err = queue.enqueueReadBuffer(cl_sync, CL_TRUE, 0, sizeof(host_sync), host_sync);
+        cl_check(err, "Reading persistent automaton sync buffer");
+
+        if (host_sync[5]) {
+            std::cout << TERM_RED <<
+                "WARNING: the persistent automaton's global barrier timed out (the device doesn't keep all " <<
+                groups << " work groups resident). Falling back to one launch per step" <<
+                TERM_RESET << std::endl;
+
+            err = queue.enqueueCopyBuffer(cl_initial_lattice, cl_t0_lattice, 0, 0, lattice_bytes);
+            cl_check(err, "Restoring the initial lattice");
+            err = queue.enqueueCopyBuffer(cl_initial_labels, cl_t0_labels, 0, 0, lattice_bytes);
+            cl_check(err, "Restoring the initial labels");
+
+            kernel_automaton_persistent_step.setArg(0, cl_luma_image);
+            kernel_automaton_persistent_step.setArg(1, bmp_width);
+            kernel_automaton_persistent_step.setArg(2, bmp_height);
+
+            AUTOMATON_STATS stats = run_automaton_loop(
+                        context,
+                        queue,
+                        max_steps,
+                        sync_interval,
+                        1,
+                        enable_profiling,
+                        [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+                kernel_automaton_persistent_step.setArg(3, cl_t0_lattice);
+                kernel_automaton_persistent_step.setArg(4, cl_t0_labels);
+                kernel_automaton_persistent_step.setArg(5, cl_t1_lattice);
+                kernel_automaton_persistent_step.setArg(6, cl_t1_labels);
+                kernel_automaton_persistent_step.setArg(7, are_diff);
+
+                enqueue_kernel(
+                            queue,
+                            kernel_automaton_persistent_step,
+                            cl::NullRange,
+                            cl::NDRange(round_up(bmp_width*bmp_height, lws)),
+                            cl::NDRange(lws),
+                            events,
+                            "Running persistent automaton step kernel");
+
+                std::swap(cl_t0_lattice, cl_t1_lattice);
+                std::swap(cl_t0_labels, cl_t1_labels);
+                return 1;
+            });
+
+            // the last step wrote into t0 before being swapped: swap back so that t1 holds it
+            std::swap(cl_t0_lattice, cl_t1_lattice);
+            std::swap(cl_t0_labels, cl_t1_labels);
+
+            if (enable_profiling) {
+                print_automaton_stats(stats, sync_interval);
+                get_memory_throughput_global(bmp_width, bmp_height, stats.kernel_time);
+            }
+            queue.finish();
+        }
+        else {
+            int steps = host_sync[4];
+            if (steps > 0 && host_sync[2 + ((steps-1) & 1)] == 0) {
                 std::cout << TERM_CYAN <<
-                    "Baling out early from automaton loop at step #" << i <<
+                    "Baling out early from automaton loop at step #" << steps-1 <<
                     std::endl << TERM_RESET;
-                break;
             }
 
+            // even steps write the t1 buffers, odd steps the t0 ones
+            if (steps > 0 && ((steps-1) & 1)) {
+                std::swap(cl_t0_labels, cl_t1_labels);
+                std::swap(cl_t0_lattice, cl_t1_lattice);
+            }
+
+            if (enable_profiling) {
+                std::cout << TERM_GREEN << "Total automaton time: " <<
+                    std::setprecision(5) <<
+                    total_time << "ms" << std::endl <<
+                    "Mean automaton time: " <<
+                    total_time/(double)std::max(steps, 1) << "ms" << std::endl <<
+                    "Device side steps: " << steps << " (1 launch, 1 host sync point)" <<
+                    TERM_RESET << std::endl;
+                get_memory_throughput_global(bmp_width, bmp_height, total_time);
+            }
+        }
+
+    }
+    else if (automaton_memory == "unionfind") {
+
+        // cl_t1_labels holds the union-find parents, which end up being the labels.
+        // cl_t0_labels holds the plateau exits
+        cl::NDRange img_ndrange(bmp_width, bmp_height);
+        std::vector<cl::Event> events;
+        std::vector<cl::Event>* profiling_events = enable_profiling ? &events : NULL;
+
+        cl::Buffer cl_t0_heights(context, CL_MEM_READ_WRITE, sizeof(cl_ulong)*bmp_width*bmp_height, NULL, &err);
+        cl_check(err, "Creating heights buffer");
+        cl::Buffer cl_t1_heights(context, CL_MEM_READ_WRITE, sizeof(cl_ulong)*bmp_width*bmp_height, NULL, &err);
+        cl_check(err, "Creating heights buffer");
+
+        kernel_uf_init_heights.setArg(0, cl_luma_image);
+        kernel_uf_init_heights.setArg(1, bmp_width);
+        kernel_uf_init_heights.setArg(2, cl_gradient_image);
+        kernel_uf_init_heights.setArg(3, cl_t0_heights);
+        enqueue_kernel(queue, kernel_uf_init_heights, cl::NullRange, img_ndrange, cl::NullRange,
+            profiling_events, "Initializing heights");
+
+        // bounded: past the lookahead the forest takes over, whatever the basin diameter
+        kernel_uf_lookahead.setArg(0, cl_luma_image);
+        kernel_uf_lookahead.setArg(1, bmp_width);
+        kernel_uf_lookahead.setArg(2, bmp_height);
+
+        AUTOMATON_STATS lookahead_stats = run_automaton_loop(
+                    context,
+                    queue,
+                    opts.uf_lookahead,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& changed, std::vector<cl::Event>* events) {
+            kernel_uf_lookahead.setArg(3, cl_t0_heights);
+            kernel_uf_lookahead.setArg(4, cl_t1_heights);
+            kernel_uf_lookahead.setArg(5, changed);
+            enqueue_kernel(queue, kernel_uf_lookahead, cl::NullRange, img_ndrange, cl::NullRange,
+                events, "Raising heights");
+            std::swap(cl_t0_heights, cl_t1_heights);
+            return 1;
+        });
+        // cl_t0_heights holds the last step
+
+        kernel_uf_descent.setArg(0, bmp_width);
+        kernel_uf_descent.setArg(1, bmp_height);
+        kernel_uf_descent.setArg(2, cl_t0_heights);
+        kernel_uf_descent.setArg(3, cl_t1_labels);
+        enqueue_kernel(queue, kernel_uf_descent, cl::NullRange, img_ndrange, cl::NullRange,
+            profiling_events, "Computing steepest descent");
+
+        kernel_uf_hook_plateaus.setArg(0, bmp_width);
+        kernel_uf_hook_plateaus.setArg(1, bmp_height);
+        kernel_uf_hook_plateaus.setArg(2, cl_t0_heights);
+        kernel_uf_hook_plateaus.setArg(3, cl_t1_labels);
+
+        AUTOMATON_STATS hook_stats = run_automaton_loop(
+                    context,
+                    queue,
+                    bmp_width*bmp_height,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& changed, std::vector<cl::Event>* events) {
+            kernel_uf_hook_plateaus.setArg(4, changed);
+            enqueue_kernel(queue, kernel_uf_hook_plateaus, cl::NullRange, img_ndrange, cl::NullRange,
+                events, "Hooking plateaus");
+            return 1;
+        });
+
+        err = queue.enqueueFillBuffer(cl_t0_labels, (cl_uint)UINT32_MAX, 0, sizeof(cl_uint)*bmp_width*bmp_height);
+        cl_check(err, "Resetting plateau exits");
+
+        kernel_uf_find_exits.setArg(0, bmp_width);
+        kernel_uf_find_exits.setArg(1, bmp_height);
+        kernel_uf_find_exits.setArg(2, cl_t0_heights);
+        kernel_uf_find_exits.setArg(3, cl_t1_labels);
+        kernel_uf_find_exits.setArg(4, cl_t0_labels);
+        enqueue_kernel(queue, kernel_uf_find_exits, cl::NullRange, img_ndrange, cl::NullRange,
+            profiling_events, "Finding plateau exits");
+
+        kernel_uf_link_exits.setArg(0, bmp_width);
+        kernel_uf_link_exits.setArg(1, cl_t1_labels);
+        kernel_uf_link_exits.setArg(2, cl_t0_labels);
+        enqueue_kernel(queue, kernel_uf_link_exits, cl::NullRange, img_ndrange, cl::NullRange,
+            profiling_events, "Linking plateau exits");
+
+        kernel_uf_compress.setArg(0, bmp_width);
+        kernel_uf_compress.setArg(1, cl_t1_labels);
+
+        AUTOMATON_STATS compress_stats = run_automaton_loop(
+                    context,
+                    queue,
+                    bmp_width*bmp_height,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& changed, std::vector<cl::Event>* events) {
+            kernel_uf_compress.setArg(2, changed);
+            enqueue_kernel(queue, kernel_uf_compress, cl::NullRange, img_ndrange, cl::NullRange,
+                events, "Compressing paths");
+            return 1;
+        });
+
+        kernel_uf_unreached_labels.setArg(0, bmp_width);
+        kernel_uf_unreached_labels.setArg(1, cl_t0_heights);
+        kernel_uf_unreached_labels.setArg(2, cl_t1_labels);
+        enqueue_kernel(queue, kernel_uf_unreached_labels, cl::NullRange, img_ndrange, cl::NullRange,
+            profiling_events, "Labelling unreached pixels");
+
+        queue.finish();
+
+        if (enable_profiling) {
+            double total_time = lookahead_stats.kernel_time + hook_stats.kernel_time + compress_stats.kernel_time;
+            for (size_t e=0; e<events.size(); e++) total_time += get_event_time(events[e]);
+            std::cout << TERM_GREEN << "Total union-find time: " <<
+                std::setprecision(5) <<
+                total_time << "ms" << std::endl <<
+                "Lookahead passes: " << lookahead_stats.steps <<
+                (lookahead_stats.converged ? " (converged, same labels as global)" : " (cut short)") << std::endl <<
+                "Hooking passes: " << hook_stats.steps << std::endl <<
+                "Path compression passes: " << compress_stats.steps << std::endl <<
+                "Total passes: " << lookahead_stats.steps + hook_stats.steps + compress_stats.steps + 5 <<
+                TERM_RESET << std::endl;
+        }
+
+    }
+    else if (automaton_memory == "arrows") {
+
+        cl::NDRange img_ndrange(bmp_width, bmp_height);
+        std::vector<cl::Event> events;
+
+        kernel_steepest_descent.setArg(0, arrow_source == "gradient" ? cl_gradient_image : cl_luma_image);
+        kernel_steepest_descent.setArg(1, bmp_width);
+        kernel_steepest_descent.setArg(2, bmp_height);
+        kernel_steepest_descent.setArg(3, cl_t0_labels);
+        enqueue_kernel(queue, kernel_steepest_descent, cl::NullRange, img_ndrange, cl::NullRange,
+            enable_profiling ? &events : NULL, "Computing steepest descent arrows");
+
+        kernel_pointer_jump.setArg(0, bmp_width);
+
+        // every step halves the longest chain
+        int max_steps = (int)ceil(log2f((float)bmp_width*bmp_height)) + 1;
+
+        AUTOMATON_STATS stats = run_automaton_loop(
+                    context,
+                    queue,
+                    max_steps,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+            kernel_pointer_jump.setArg(1, cl_t0_labels);
+            kernel_pointer_jump.setArg(2, cl_t1_labels);
+            kernel_pointer_jump.setArg(3, are_diff);
+            enqueue_kernel(queue, kernel_pointer_jump, cl::NullRange, img_ndrange, cl::NullRange,
+                events, "Running pointer jumping kernel");
             std::swap(cl_t0_labels, cl_t1_labels);
-            std::swap(cl_t0_lattice, cl_t1_lattice);
+            return 1;
+        });
+
+        // the last step wrote into the t0 buffer before being swapped, bring it back to t1
+        std::swap(cl_t0_labels, cl_t1_labels);
+
+        queue.finish();
+
+        if (enable_profiling) {
+            if (!events.empty()) stats.kernel_time += get_event_time(events[0]);
+            print_automaton_stats(stats, sync_interval);
+        }
+
+    }
+    else if (automaton_memory == "frontier") {
+
+        cl_uint img_size = bmp_width*bmp_height;
+        cl_int lws = lws_cli ? lws_cli : pref_gs_mult;
+
+        cl::Buffer cl_worklist(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*img_size);
+        cl::Buffer cl_next_worklist(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*img_size);
+        cl::Buffer cl_next_worklist_size(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+        cl::Buffer cl_stamps(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*img_size);
+
+        // the first step has to look at every pixel
+        kernel_init_worklist.setArg(0, cl_worklist);
+        err = queue.enqueueNDRangeKernel(kernel_init_worklist, cl::NullRange, cl::NDRange(img_size), cl::NullRange);
+        cl_check(err, "Initializing the worklist");
+        err = queue.enqueueFillBuffer(cl_stamps, (cl_uint)UINT32_MAX, 0, sizeof(cl_uint)*img_size);
+        cl_check(err, "Resetting worklist stamps");
+
+        kernel_automaton_frontier_update.setArg(0, cl_luma_image);
+        kernel_automaton_frontier_update.setArg(1, bmp_width);
+        kernel_automaton_frontier_update.setArg(2, bmp_height);
+        kernel_automaton_frontier_update.setArg(3, cl_t0_lattice);
+        kernel_automaton_frontier_update.setArg(4, cl_t0_labels);
+        kernel_automaton_frontier_update.setArg(5, cl_t1_lattice);
+        kernel_automaton_frontier_update.setArg(6, cl_t1_labels);
+
+        kernel_automaton_frontier_commit.setArg(0, bmp_width);
+        kernel_automaton_frontier_commit.setArg(1, bmp_height);
+        kernel_automaton_frontier_commit.setArg(2, cl_t0_lattice);
+        kernel_automaton_frontier_commit.setArg(3, cl_t0_labels);
+        kernel_automaton_frontier_commit.setArg(4, cl_t1_lattice);
+        kernel_automaton_frontier_commit.setArg(5, cl_t1_labels);
+        kernel_automaton_frontier_commit.setArg(9, cl_next_worklist_size);
+        kernel_automaton_frontier_commit.setArg(10, cl_stamps);
+
+        std::vector<cl::Event> events;
+        cl_uint worklist_size = img_size;
+        unsigned long long processed_pixels = 0;
+        int steps = 0;
+        auto wall_start = std::chrono::steady_clock::now();
+
+        for (int i=0; i<=std::max(bmp_width, bmp_height) && worklist_size; i++) {
+            cl::NDRange worklist_ndrange(round_up(worklist_size, lws));
+            processed_pixels += worklist_size;
+
+            kernel_automaton_frontier_update.setArg(7, cl_worklist);
+            kernel_automaton_frontier_update.setArg(8, worklist_size);
+            enqueue_kernel(queue, kernel_automaton_frontier_update, cl::NullRange, worklist_ndrange, cl::NDRange(lws),
+                enable_profiling ? &events : NULL, "Running frontier automaton update (step #"+std::to_string(i)+")");
+
+            err = queue.enqueueFillBuffer(cl_next_worklist_size, (cl_uint)0, 0, sizeof(cl_uint));
+            cl_check(err, "Resetting worklist size");
+
+            kernel_automaton_frontier_commit.setArg(6, cl_worklist);
+            kernel_automaton_frontier_commit.setArg(7, worklist_size);
+            kernel_automaton_frontier_commit.setArg(8, cl_next_worklist);
+            kernel_automaton_frontier_commit.setArg(11, (cl_uint)i);
+            enqueue_kernel(queue, kernel_automaton_frontier_commit, cl::NullRange, worklist_ndrange, cl::NDRange(lws),
+                enable_profiling ? &events : NULL, "Running frontier automaton commit (step #"+std::to_string(i)+")");
+
+            // the size of the next worklist sizes the next launch: this is also the convergence check
+            queue.enqueueReadBuffer(cl_next_worklist_size, CL_TRUE, 0, sizeof(cl_uint), &worklist_size);
+            std::swap(cl_worklist, cl_next_worklist);
+            steps++;
+
+            if (!worklist_size) {
+                std::cout << TERM_CYAN <<
+                    "Baling out early from automaton loop at step #" << i <<
+                    std::endl << TERM_RESET;
+            }
         }
 
+        // the current state is in the t0 buffers
+        std::swap(cl_t0_labels, cl_t1_labels);
+        std::swap(cl_t0_lattice, cl_t1_lattice);
+
         if (enable_profiling) {
+            double total_time = 0;
+            for (size_t e=0; e<events.size(); e++) total_time += get_event_time(events[e]);
+            double wall_time = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - wall_start).count();
             std::cout << TERM_GREEN << "Total automaton time: " <<
                 std::setprecision(5) <<
                 total_time << "ms" << std::endl <<
                 "Mean automaton time: " <<
-                total_time/(double)automaton_iterations << "ms" <<
+                total_time/(double)std::max(steps, 1) << "ms" << std::endl <<
+                "Host wall time: " << wall_time << "ms" << std::endl <<
+                "Pixels processed: " << processed_pixels <<
+                " (full frame steps: " << (unsigned long long)img_size*steps << ", " <<
+                100.0*processed_pixels/((double)img_size*std::max(steps, 1)) << "%)" <<
                 TERM_RESET << std::endl;
-            get_memory_throughput_global(bmp_width, bmp_height, total_time, lws);
+        }
+
+    }
+    else if (automaton_memory == "inplace") {
+
+        cl::Buffer cl_packed(context, CL_MEM_READ_WRITE, sizeof(cl_ulong)*bmp_width*bmp_height);
+
+        kernel_init_t0_packed.setArg(0, cl_packed);
+        kernel_init_t0_packed.setArg(1, bmp_width);
+        kernel_init_t0_packed.setArg(2, cl_gradient_image);
+
+        queue.enqueueNDRangeKernel(
+                    kernel_init_t0_packed,
+                    cl::NullRange,
+                    cl::NDRange(bmp_width, bmp_height),
+                    cl::NullRange);
+
+        kernel_automaton_inplace.setArg(0, cl_luma_image);
+        kernel_automaton_inplace.setArg(1, bmp_width);
+        kernel_automaton_inplace.setArg(2, bmp_height);
+        kernel_automaton_inplace.setArg(3, cl_packed);
+
+        AUTOMATON_STATS stats = run_automaton_loop(
+                    context,
+                    queue,
+                    std::max(bmp_width, bmp_height)+1,
+                    sync_interval,
+                    1,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+            kernel_automaton_inplace.setArg(4, are_diff);
+
+            enqueue_kernel(
+                        queue,
+                        kernel_automaton_inplace,
+                        cl::NullRange,
+                        cl::NDRange(gmem_gws_width, gmem_gws_height),
+                        gmem_local_ndrange,
+                        events,
+                        "Running automaton kernel");
+            return 1;
+        });
+
+        kernel_unpack_labels.setArg(0, cl_packed);
+        kernel_unpack_labels.setArg(1, bmp_width);
+        kernel_unpack_labels.setArg(2, cl_t1_labels);
+
+        err = queue.enqueueNDRangeKernel(
+                    kernel_unpack_labels,
+                    cl::NullRange,
+                    cl::NDRange(bmp_width, bmp_height),
+                    cl::NullRange);
+        cl_check(err, "Unpacking labels");
+
+        if (enable_profiling) {
+            print_automaton_stats(stats, sync_interval);
+            get_memory_throughput_global(bmp_width, bmp_height, stats.kernel_time, true, 6*8);
         }
 
         queue.finish();
@@ -478,67 +1707,57 @@ int main(int argc, const char** argv) {
         queue.finish();
 
 
-        kernel_automaton_image.setArg(0, cl_luma_image);
-        kernel_automaton_image.setArg(1, bmp_width);
-        kernel_automaton_image.setArg(2, bmp_height);
-        kernel_automaton_image.setArg(7, cl_are_diff);
-
-        double total_time = 0;
-        int automaton_iterations = 0;
+        // with the red-black schedule a step is a whole sweep made of two half steps
+        cl::Kernel kernel_image_automaton = schedule == "redblack" ?
+            kernel_automaton_image_redblack : kernel_automaton_image;
+        int half_steps = schedule == "redblack" ? 2 : 1;
 
-        for (int i=0; i<=std::max(bmp_width, bmp_height); i++) {
-            kernel_automaton_image.setArg(3, cl_t0_lattice_image);
-            kernel_automaton_image.setArg(4, cl_t0_labels_image);
-            kernel_automaton_image.setArg(5, cl_t1_lattice_image);
-            kernel_automaton_image.setArg(6, cl_t1_labels_image);
+        kernel_image_automaton.setArg(0, cl_luma_image);
+        kernel_image_automaton.setArg(1, bmp_width);
+        kernel_image_automaton.setArg(2, bmp_height);
 
-            host_init_are_diff[0] = 0;
-            queue.enqueueWriteBuffer(cl_are_diff, CL_TRUE, 0, sizeof(cl_uint), host_init_are_diff);
-            queue.finish();
-
-            // Insert profiling here
-            if (enable_profiling) {
-                total_time += profile_kernel(
+        AUTOMATON_STATS stats = run_automaton_loop(
+                    context,
+                    queue,
+                    (std::max(bmp_width, bmp_height) + half_steps) / half_steps,
+                    sync_interval,
+                    half_steps,
+                    enable_profiling,
+                    [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+            for (int color=0; color<half_steps; color++) {
+                kernel_image_automaton.setArg(3, cl_t0_lattice_image);
+                kernel_image_automaton.setArg(4, cl_t0_labels_image);
+                kernel_image_automaton.setArg(5, cl_t1_lattice_image);
+                kernel_image_automaton.setArg(6, cl_t1_labels_image);
+                kernel_image_automaton.setArg(7, are_diff);
+                if (schedule == "redblack") kernel_image_automaton.setArg(8, color);
+
+                enqueue_kernel(
                             queue,
-                            kernel_automaton_image,
+                            kernel_image_automaton,
                             cl::NullRange,
                             cl::NDRange(gmem_gws_width, gmem_gws_height),
                             gmem_local_ndrange,
-                            "Step " + std::to_string(i) + ": ");
-                automaton_iterations++;
-            }
-            else {
-                err = queue.enqueueNDRangeKernel(
-                            kernel_automaton_image,
-                            cl::NullRange,
-                            cl::NDRange(gmem_gws_width, gmem_gws_height),
-                            gmem_local_ndrange);
-                queue.finish();
-                cl_check(err, "Running automaton kernel (step #"+std::to_string(i)+")");
-            }
-
-            queue.enqueueReadBuffer(cl_are_diff, CL_TRUE, 0, sizeof(uint32_t), host_init_are_diff);
-            queue.finish();
+                            events,
+                            "Running automaton kernel");
 
-            if (!host_init_are_diff[0])  {
-                std::cout << TERM_CYAN <<
-                    "Baling out early from automaton loop at step #" << i <<
-                    std::endl << TERM_RESET;
-                break;
+                std::swap(cl_t0_labels_image, cl_t1_labels_image);
+                std::swap(cl_t0_lattice_image, cl_t1_lattice_image);
             }
+            return half_steps;
+        });
 
-            std::swap(cl_t0_labels_image, cl_t1_labels_image);
-            std::swap(cl_t0_lattice_image, cl_t1_lattice_image);
-        }
+        // the last step wrote into the t0 images before being swapped, bring them back to t1
+        std::swap(cl_t0_labels_image, cl_t1_labels_image);
+        std::swap(cl_t0_lattice_image, cl_t1_lattice_image);
 
         if (enable_profiling) {
-            std::cout << TERM_GREEN << "Total automaton time: " <<
-                std::setprecision(5) <<
-                total_time << "ms" << std::endl <<
-                "Mean automaton time: " <<
-                total_time/(double)automaton_iterations << "ms" <<
+            print_automaton_stats(stats, sync_interval);
+            if (schedule == "redblack") std::cout << TERM_GREEN <<
+                "Sweeps: " << stats.steps <<
+                ", half steps: " << stats.launches <<
                 TERM_RESET << std::endl;
-            get_memory_throughput_global(bmp_width, bmp_height, total_time);
+            get_memory_throughput_global(bmp_width, bmp_height, stats.kernel_time);
         }
 
         queue.finish();
@@ -553,15 +1772,15 @@ int main(int argc, const char** argv) {
                         kernel_color_watershed_image,
                         cl::NullRange,
                         cl::NDRange(bmp_width, bmp_height),
-                        cl::NullRange);
+                        cl::NullRange,
+                        &color_wait_events,
+                        &frame.computed);
 
         cl_check(err, "Coloring watershed");
 
-        queue.finish();
-
     }
 
-    if (automaton_memory == "global" || automaton_memory == "local") {
+    if (automaton_buffers) {
         kernel_color_watershed.setArg(0, cl_input_image);
         kernel_color_watershed.setArg(1, bmp_width);
         kernel_color_watershed.setArg(2, bmp_height);
@@ -572,49 +1791,756 @@ int main(int argc, const char** argv) {
                         kernel_color_watershed,
                         cl::NullRange,
                         cl::NDRange(bmp_width, bmp_height),
-                        cl::NullRange);
+                        cl::NullRange,
+                        &color_wait_events,
+                        &frame.computed);
 
         cl_check(err, "Coloring watershed");
+    }
+    queue.flush();
 
-        queue.finish();
+    // the coloring is the last to read the input image
+    slot.input_free = frame.computed;
+
+    // t1 now holds this frame's converged state, the next frame can start from it
+    if (opts.warm_start) env.pool.warm_valid = true;
+    if (opts.dirty_rects) {
+        env.pool.prev_rgba = frame.rgba;
+        env.pool.dirty_valid = true;
     }
 
     std::cout << TERM_CYAN <<
         "Automaton mode: " << automaton_memory <<
         TERM_RESET << std::endl << "********************" << std::endl;
+}
 
-    uint8_t* host_outimage = new uint8_t[bmp_width*bmp_height*4];
-    uint8_t* rgb_outimage = new uint8_t[bmp_width*bmp_height*3];
+/*
+    Tiled automaton: the frame never goes to the device as a whole, luma,
+    gradient and coloring are done on the host and only the automaton runs
+    on the device, one tile at a time (see tiles.hpp).
+ */
+void compute_frame_tiled(
+        WATERSHED_ENV &env,
+        const WATERSHED_OPTIONS &opts,
+        FRAME &frame) {
+
+    if ((uint64_t)frame.width*frame.height > UINT32_MAX) {
+        std::cerr << TERM_RED << "Error: " << frame.in_path << " has too many pixels for 32 bit labels" << TERM_RESET << std::endl;
+        exit(1);
+    }
 
-    cl::size_t<3> ri_origin;
-    ri_origin[0] = 0;
-    ri_origin[1] = 0;
-    ri_origin[2] = 0;
-    cl::size_t<3> ri_region;
-    ri_region[0] = bmp_width;
-    ri_region[1] = bmp_height;
-    ri_region[2] = 1;
-    err = queue.enqueueReadImage(
-                        cl_output_image,
-                        CL_TRUE,
-                        ri_origin,
-                        ri_region,
-                        0,
-                        0,
-                        host_outimage);
-    cl_check(err, "Reading image from device");
+    auto tiled_start = std::chrono::high_resolution_clock::now();
+
+    std::vector<uint8_t> luma;
+    std::vector<uint8_t> gradient;
+    make_luma_host(frame.rgba, frame.width, frame.height, luma);
+    make_gradient_host(luma, frame.width, frame.height, gradient);
+
+    std::string build_options = mode_options("tiled");
+    cl::Program program = get_program(env.program_cache, env.context, env.device, ocl_source_embedded, build_options);
+    cl::Kernel kernel_automaton_tile = get_kernel(env.program_cache, program, build_options, "automaton_tile");
+
+    std::vector<cl_uint> lattice;
+    std::vector<cl_uint> labels;
+    TILED_STATS stats = run_tiled(
+                env.tiles,
+                env.context,
+                env.queue,
+                kernel_automaton_tile,
+                luma,
+                gradient,
+                frame.width,
+                frame.height,
+                opts.sync_interval,
+                lattice,
+                labels);
+
+    color_labels_host(frame.rgba, frame.width, frame.height, labels, frame.output_rgba);
+
+    double tiled_time = std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - tiled_start).count();
+    std::cout << TERM_CYAN <<
+        "Tiled: " << stats.tiles << " tiles of " << env.tiles.tile_size << "x" << env.tiles.tile_size << ", " <<
+        stats.visits << " tile visits in " << stats.sweeps << " sweeps, " <<
+        stats.steps << " automaton steps, " <<
+        tiled_time*1000 << " ms" <<
+        TERM_RESET << std::endl;
+}
 
-    rgba2rgb(
-        host_outimage,
-        bmp_width*bmp_height,
-        rgb_outimage
-    );
+CPU_STATS run_cpu_schedule(
+        const WATERSHED_OPTIONS &opts,
+        const std::vector<uint8_t> &luma,
+        const std::vector<uint8_t> &gradient,
+        int width,
+        int height,
+        int threads,
+        std::vector<uint32_t> &labels) {
+
+    if (opts.cpu_schedule == "steal") return run_cpu_steal(luma, gradient, width, height, threads, labels);
+    if (opts.cpu_schedule == "sweep") return run_cpu_sweep(luma, gradient, width, height, threads, labels);
+    return run_cpu_automaton(luma, gradient, width, height, threads, opts.cpu_simd, labels);
+}
+
+/*
+    Reruns the automaton of a frame on 1, 2, 4... threads, up to --threads
+    and at most 64, and reports the speedup over a single thread.
+ */
+void report_cpu_scaling(
+        const WATERSHED_OPTIONS &opts,
+        const std::vector<uint8_t> &luma,
+        const std::vector<uint8_t> &gradient,
+        int width,
+        int height) {
+
+    std::vector<int> counts;
+    int max_threads = std::min(opts.threads, 64);
+    for (int threads=1; threads<max_threads; threads*=2) counts.push_back(threads);
+    counts.push_back(max_threads);
+
+    double single_time = 0;
+    std::vector<uint32_t> labels;
+    for (size_t i=0; i<counts.size(); i++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        CPU_STATS stats = run_cpu_schedule(opts, luma, gradient, width, height, counts[i], labels);
+        double time = std::chrono::duration<double>(
+            std::chrono::high_resolution_clock::now() - start).count();
+        if (i == 0) single_time = time;
+        std::cout << TERM_CYAN <<
+            "Scaling (" << opts.cpu_schedule << "): " << stats.threads << " threads, " <<
+            time*1000 << " ms, " <<
+            "speedup " << single_time/time << ", " <<
+            "efficiency " << 100*single_time/time/stats.threads << "%" <<
+            TERM_RESET << std::endl;
+    }
+}
+
+/*
+    CPU backend: the same init_t0, automaton_global and color_watershed as
+    the global automaton, run natively (see cpu_backend.hpp).
+ */
+void compute_frame_cpu(
+        const WATERSHED_OPTIONS &opts,
+        FRAME &frame) {
+
+    auto cpu_start = std::chrono::high_resolution_clock::now();
+
+    std::vector<uint8_t> luma;
+    std::vector<uint8_t> gradient;
+    make_luma_host(frame.rgba, frame.width, frame.height, luma);
+    make_gradient_host(luma, frame.width, frame.height, gradient);
+
+    std::vector<uint32_t> labels;
+    CPU_STATS stats = run_cpu_schedule(opts, luma, gradient, frame.width, frame.height, opts.threads, labels);
+
+    color_labels_host(frame.rgba, frame.width, frame.height, labels, frame.output_rgba);
+
+    double cpu_time = std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - cpu_start).count();
+    if (opts.cpu_schedule == "steal") std::cout << TERM_CYAN <<
+        "CPU: " << stats.threads << " threads, " << stats.tiles << " tiles, " <<
+        stats.visits << " tile visits, " << stats.steals << " steals, " <<
+        cpu_time*1000 << " ms" <<
+        TERM_RESET << std::endl;
+    else if (opts.cpu_schedule == "sweep") std::cout << TERM_CYAN <<
+        "CPU: " << stats.threads << " threads, " <<
+        stats.steps << " raster passes, " <<
+        cpu_time*1000 << " ms" <<
+        TERM_RESET << std::endl;
+    else std::cout << TERM_CYAN <<
+        "CPU: " << stats.threads << " threads (" << stats.isa << "), " << stats.tiles << " tiles, " <<
+        stats.steps << " automaton steps, " <<
+        cpu_time*1000 << " ms" <<
+        TERM_RESET << std::endl;
+
+    if (opts.cpu_scaling) report_cpu_scaling(opts, luma, gradient, frame.width, frame.height);
+}
+
+/*
+    Flood backend: the same seeds and coloring as the global automaton, with
+    the basins grown by a priority flood on the host (see flood.hpp).
+ */
+void compute_frame_flood(FRAME &frame) {
+
+    auto flood_start = std::chrono::high_resolution_clock::now();
+
+    std::vector<uint8_t> luma;
+    std::vector<uint8_t> gradient;
+    make_luma_host(frame.rgba, frame.width, frame.height, luma);
+    make_gradient_host(luma, frame.width, frame.height, gradient);
+
+    std::vector<uint32_t> labels;
+    FLOOD_STATS stats = run_flood(luma, gradient, frame.width, frame.height, labels);
+
+    color_labels_host(frame.rgba, frame.width, frame.height, labels, frame.output_rgba);
+
+    double flood_time = std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - flood_start).count();
+    std::cout << TERM_CYAN <<
+        "Flood: " << stats.seeds << " seeds, " << stats.pushes << " queue pushes, " <<
+        flood_time*1000 << " ms" <<
+        TERM_RESET << std::endl;
+}
+
+// computes a decoded frame into frame.output_rgba, without the pipeline
+void process_frame(
+        WATERSHED_ENV &env,
+        const WATERSHED_OPTIONS &opts,
+        FRAME &frame) {
+
+    if (opts.backend == "cpu") compute_frame_cpu(opts, frame);
+    else if (opts.backend == "flood") compute_frame_flood(frame);
+    else if (opts.automaton_memory == "tiled") compute_frame_tiled(env, opts, frame);
+    else {
+        acquire_pipeline_slot(env.pool, env.context, frame.slot, frame.width, frame.height);
+        upload_frame(env, frame);
+        compute_frame(env, opts, frame);
+        download_frame(env, frame);
+        frame.downloaded.wait();
+    }
+}
+
+// returns the megapixels processed
+double process_image(
+        WATERSHED_ENV &env,
+        const WATERSHED_OPTIONS &opts,
+        const std::string &bmp_path,
+        const std::string &out_path) {
+
+    FRAME frame;
+    frame.in_path = bmp_path;
+    frame.out_path = out_path;
+    frame.slot = 0;
+
+    decode_frame(frame);
+    process_frame(env, opts, frame);
+    encode_frame(frame);
+    return (double)frame.width*frame.height / 1e6;
+}
+
+/*
+    Where the pipeline gets its frames from and where it hands them over once
+    downloaded: a source fills in the decoded frame and returns false at the
+    end of the input, a sink gets the frames in order.
+ */
+typedef std::function<bool(FRAME& frame)> FRAME_SOURCE;
+typedef std::function<void(FRAME& frame)> FRAME_SINK;
+
+/*
+    Execution overlapping the stages of consecutive images: a worker
+    thread decodes ahead, frame N+1 is uploaded on its own queue while
+    frame N computes, frame N-1 is read back on a third queue and encoded
+    by another worker thread. Steady state throughput is bound by the
+    slowest stage rather than by their sum.
+    total is only used for the progress messages, 0 when unknown (streams).
+ */
+void run_pipeline(
+        WATERSHED_ENV &env,
+        const WATERSHED_OPTIONS &opts,
+        FRAME_SOURCE source,
+        FRAME_SINK sink,
+        size_t total,
+        double &megapixels,
+        size_t &frames) {
+
+    FRAME_QUEUE<FRAME*> decoded(PIPELINE_SLOTS);
+    FRAME_QUEUE<FRAME*> computed(PIPELINE_SLOTS);
+    std::mutex megapixels_mutex;
+    megapixels = 0;
+
+    frames = 0;
+
+    std::thread decoder([&]() {
+        while (true) {
+            FRAME* frame = new FRAME;
+            frame->start = std::chrono::high_resolution_clock::now();
+            if (!source(*frame)) {
+                delete frame;
+                break;
+            }
+            decoded.push(frame);
+        }
+        decoded.close();
+    });
+
+    std::thread encoder([&]() {
+        FRAME* frame;
+        size_t done = 0;
+        while (computed.pop(frame)) {
+            frame->downloaded.wait();
+            sink(*frame);
+            double latency = std::chrono::duration<double>(
+                std::chrono::high_resolution_clock::now() - frame->start).count();
+            done++;
+            std::cout << TERM_CYAN <<
+                "Image " << done;
+            if (total) std::cout << "/" << total;
+            std::cout << ": " <<
+                latency*1000 << " ms latency" <<
+                TERM_RESET << std::endl;
+            {
+                std::lock_guard<std::mutex> lock(megapixels_mutex);
+                megapixels += (double)frame->width*frame->height / 1e6;
+                frames = done;
+            }
+            delete frame;
+        }
+    });
+
+    int frame_index = 0;
+    FRAME* current = NULL;
+    if (decoded.pop(current)) {
+        current->slot = frame_index++ % PIPELINE_SLOTS;
+        acquire_pipeline_slot(env.pool, env.context, current->slot, current->width, current->height);
+        upload_frame(env, *current);
+    }
+    while (current) {
+        // enqueue the next upload before computing, so the copy runs alongside the automaton
+        FRAME* next = NULL;
+        if (decoded.pop(next)) {
+            next->slot = frame_index++ % PIPELINE_SLOTS;
+            acquire_pipeline_slot(env.pool, env.context, next->slot, next->width, next->height);
+            upload_frame(env, *next);
+        }
+        compute_frame(env, opts, *current);
+        download_frame(env, *current);
+        computed.push(current);
+        current = next;
+    }
+    computed.close();
+
+    decoder.join();
+    encoder.join();
+}
+
+int main(int argc, const char** argv) {
+
+    std::string pwd = get_dir(argv[0]);
+
+    cxxopts::Options options("ocl_watershed", "OpenCL implementation of the watershed transform");
+    options.add_options()
+        ("p,profiling", "Enable profiling")
+        ("i,input", "Input PPM image file path",
+            cxxopts::value<std::string>())
+        ("o,output", "Output file path",
+            cxxopts::value<std::string>()->default_value(pwd + "/out.ppm"))
+        ("l,localworksize", "Local work size",
+            cxxopts::value<int>()->default_value("0"))
+        ("a,automaton", "Automaton implementation (valid values: global, local, image, persistent, unionfind, arrows, frontier, inplace, tiled)\n\tglobal: use global memory\n\tlocal: use local memory\n\timage: use texture memory\n\tpersistent: single launch, one work group per compute unit looping on the device until convergence\n\tunionfind: steepest descent links over lower bounds of the automaton's costs, plateaus merged with union-find (not a cellular automaton, see --uflookahead); same labels as global when the lookahead converges\n\tarrows: steepest descent arrows resolved with pointer jumping, plateaus are not merged\n\tfrontier: global memory, only updating the pixels that changed in the previous step and their neighbors\n\tinplace: single packed lattice buffer updated in place (chaotic relaxation), ties go to the lowest label; needs cl_khr_int64_extended_atomics\n\ttiled: out of core, the image stays in host memory and is streamed through the device in tiles (see --tilesize); same costs as global, labels can differ where two seeds reach a pixel at the same cost",
+            cxxopts::value<std::string>()->default_value("global"))
+        ("P,selectplatform", "Manually select platform in runtime",
+            cxxopts::value<int>()->default_value("0"))
+        ("s,syncinterval", "Number of automaton steps enqueued back to back between convergence checks",
+            cxxopts::value<int>()->default_value("1"))
+        ("arrowsource", "Image the steepest descent arrows are computed on with -a arrows (valid values: luma, gradient)",
+            cxxopts::value<std::string>()->default_value("luma"))
+        ("schedule", "Update schedule of the global and image automata (valid values: jacobi, redblack)\n\tjacobi: every pixel reads the previous step\n\tredblack: two half steps over alternating checkerboard colors, each reading what the other just wrote",
+            cxxopts::value<std::string>()->default_value("jacobi"))
+        ("packed", "Store lattice and labels packed in a single 8 byte element per pixel (global automaton only)")
+        ("nojit", "Don't specialize the kernels on the image size and local work size at build time")
+        ("nocache", "Don't use the on disk program binary cache")
+        ("cachedir", "Program binary cache directory",
+            cxxopts::value<std::string>()->default_value(default_program_cache_dir()))
+        ("batch", "Process every .ppm in a directory, or every path listed in a file, reusing the device setup",
+            cxxopts::value<std::string>())
+        ("stream", "Read frames from stdin and write the segmented frames to stdout: concatenated binary PPMs, or raw rgb24 with --rawsize")
+        ("rawsize", "Frame size of a raw rgb24 stream (e.g. ffmpeg -f rawvideo -pix_fmt rgb24), as WIDTHxHEIGHT",
+            cxxopts::value<std::string>())
+        ("warmstart", "Start every frame of a batch or stream from the previous frame's converged lattice, only recomputing the basins that changed (global with the jacobi schedule, local, persistent and frontier automata)")
+        ("warmthreshold", "Luma difference above which a pixel counts as changed with --warmstart",
+            cxxopts::value<int>()->default_value("0"))
+        ("dirtyrects", "Only recompute the areas of a batch or stream frame that changed since the previous one and the basins they touch, then let the whole frame settle; labels may differ from a full recompute at equal cost ties (global automaton, jacobi schedule)")
+        ("dirtymargin", "Margin in pixels around the changed areas with --dirtyrects, for the changes to propagate",
+            cxxopts::value<int>()->default_value("32"))
+        ("multidevice", "Split the image in horizontal strips across every OpenCL device of every platform (global automaton, jacobi schedule)")
+        ("subdevices", "With --multidevice, partition the first device of the selected platform into this many sub-devices instead",
+            cxxopts::value<int>()->default_value("0"))
+        ("exchangeinterval", "Automaton steps between boundary row exchanges with --multidevice",
+            cxxopts::value<int>()->default_value("1"))
+        ("backend", "Where the watershed runs (valid values: opencl, cpu, flood)\n\topencl: on the selected OpenCL device, see -a\n\tcpu: natively on a thread pool, same output as the global automaton; used when no OpenCL platform is found\n\tflood: sequential priority flood from the same seeds, fastest on a single core, ties between basins may go differently",
+            cxxopts::value<std::string>()->default_value("opencl"))
+        ("threads", "Threads of the cpu backend, 0 for one per hardware thread",
+            cxxopts::value<int>()->default_value("0"))
+        ("cpuschedule", "How the cpu backend spreads the automaton over its threads (valid values: static, steal, sweep)\n\tstatic: lockstep jacobi steps over a fixed partition, same output as the global automaton\n\tsteal: tiles relaxed until stable on work stealing deques, only requeued when a neighbor's border changes; same output as the inplace automaton\n\tsweep: alternating forward and backward raster passes updating in place, rows in parallel as a wavefront; same output as the inplace automaton",
+            cxxopts::value<std::string>()->default_value("static"))
+        ("scaling", "With the cpu backend, rerun the automaton of every image on 1, 2, 4... threads up to --threads (at most 64) and report the speedup")
+        ("nosimd", "Run the cpu backend automaton without AVX2/AVX-512, even if the CPU has them")
+        ("tilesize", "Tile side in pixels of the tiled automaton",
+            cxxopts::value<int>()->default_value("1024"))
+        ("uflookahead", "Most cost lower bound steps of the union-find engine before the forest is built; labels match the global automaton when they converge within it, 0 descends on the luma alone",
+            cxxopts::value<int>()->default_value("32"))
+        ("nopipeline", "In batch and stream mode, process the images one after the other instead of overlapping decoding, upload, compute, download and encoding")
+        ("outdir", "Output directory in batch mode, outputs are named <input name>_out.ppm",
+            cxxopts::value<std::string>()->default_value(pwd))
+        ("k,temporalsteps", "Relaxation steps run in local memory per launch of the local automaton (temporal blocking)",
+            cxxopts::value<int>()->default_value("1"));
+
+
+
+    auto result = options.parse(argc, argv);
+
+    std::string bmp_path="";
+    std::string out_path="";
+
+    std::string batch_path = "";
+    bool stream = result.count("stream");
+    if (stream) {
+        // stdout carries the frames, everything else goes to stderr
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    else if (result.count("batch") == 1) {
+        batch_path = result["batch"].as<std::string>();
+    }
+    else if (result.count("i") == 1) {
+        bmp_path = result["i"].as<std::string>();
+    }
+    else {
+        std::cout << options.help() << std::endl;
+        exit(1);
+    }
 
-    write_ppm(rgb_outimage,
-        3*bmp_width*bmp_height,
-        bmp_width,
-        bmp_height,
-        out_path);
+    int lws_cli = result["l"].as<int>();
+    std::string backend = result["backend"].as<std::string>();
+    if (backend != "opencl" && backend != "cpu" && backend != "flood") {
+        std::cout << TERM_RED <<
+            "WARNING: provided backend argument (--backend) invalid. Falling back to opencl" <<
+            TERM_RESET << std::endl;
+        backend = "opencl";
+    }
+    if (backend == "opencl" && !ocl_platforms_available()) {
+        std::cout << TERM_RED <<
+            "WARNING: no OpenCL platform found. Falling back to the cpu backend" <<
+            TERM_RESET << std::endl;
+        backend = "cpu";
+    }
+    int threads = result["threads"].as<int>();
+    if (threads < 0) {
+        std::cout << TERM_RED <<
+            "WARNING: provided thread count argument (--threads) invalid. Falling back to 0" <<
+            TERM_RESET << std::endl;
+        threads = 0;
+    }
+    std::string cpu_schedule = result["cpuschedule"].as<std::string>();
+    if (cpu_schedule != "static" && cpu_schedule != "steal" && cpu_schedule != "sweep") {
+        std::cout << TERM_RED <<
+            "WARNING: provided cpu schedule argument (--cpuschedule) invalid. Falling back to static" <<
+            TERM_RESET << std::endl;
+        cpu_schedule = "static";
+    }
+    std::string automaton_memory = result["a"].as<std::string>();
+    if (automaton_memory != "global" && automaton_memory != "local" && automaton_memory != "image" &&
+        automaton_memory != "persistent" && automaton_memory != "unionfind" &&
+        automaton_memory != "arrows" && automaton_memory != "frontier" &&
+        automaton_memory != "inplace" && automaton_memory != "tiled") {
+        std::cout << TERM_RED <<
+            "WARNING: provided automaton implementation argument (-a, --automaton) invalid. Falling back to global" <<
+            TERM_RESET << std::endl;
+        automaton_memory = "global";
+    }
+
+    out_path = result["o"].as<std::string>();
+    bool enable_profiling = result.count("p");
+    int selectplatform = result["P"].as<int>();
+    int sync_interval = result["s"].as<int>();
+    if (sync_interval < 1) {
+        std::cout << TERM_RED <<
+            "WARNING: provided sync interval argument (-s, --syncinterval) invalid. Falling back to 1" <<
+            TERM_RESET << std::endl;
+        sync_interval = 1;
+    }
+    int temporal_steps_cli = result["k"].as<int>();
+    if (temporal_steps_cli < 1) {
+        std::cout << TERM_RED <<
+            "WARNING: provided temporal steps argument (-k, --temporalsteps) invalid. Falling back to 1" <<
+            TERM_RESET << std::endl;
+        temporal_steps_cli = 1;
+    }
+    std::string schedule = result["schedule"].as<std::string>();
+    if (schedule != "jacobi" && schedule != "redblack") {
+        std::cout << TERM_RED <<
+            "WARNING: provided schedule argument (--schedule) invalid. Falling back to jacobi" <<
+            TERM_RESET << std::endl;
+        schedule = "jacobi";
+    }
+    if (schedule == "redblack" && automaton_memory != "global" && automaton_memory != "image") {
+        std::cout << TERM_RED <<
+            "WARNING: the red-black schedule (--schedule) is only available with the global and image automata. Falling back to jacobi" <<
+            TERM_RESET << std::endl;
+        schedule = "jacobi";
+    }
+    bool packed_storage = result.count("packed");
+    if (packed_storage && (automaton_memory != "global" || schedule == "redblack")) {
+        std::cout << TERM_RED <<
+            "WARNING: packed storage (--packed) is only available with the global automaton and the jacobi schedule. Ignoring it" <<
+            TERM_RESET << std::endl;
+        packed_storage = false;
+    }
+    bool jit_specialize = !result.count("nojit");
+    bool warm_start = result.count("warmstart");
+    // red-black updates t0 in place and never leaves its result in t1, where the warm start reads it
+    if (warm_start && (packed_storage || schedule == "redblack" ||
+        (automaton_memory != "global" && automaton_memory != "local" &&
+         automaton_memory != "persistent" && automaton_memory != "frontier"))) {
+        std::cout << TERM_RED <<
+            "WARNING: warm start (--warmstart) is only available with the global (unpacked, jacobi), local, persistent and frontier automata. Ignoring it" <<
+            TERM_RESET << std::endl;
+        warm_start = false;
+    }
+    int warm_threshold = result["warmthreshold"].as<int>();
+    if (warm_threshold < 0) {
+        std::cout << TERM_RED <<
+            "WARNING: provided warm start threshold argument (--warmthreshold) invalid. Falling back to 0" <<
+            TERM_RESET << std::endl;
+        warm_threshold = 0;
+    }
+    bool dirty_rects = result.count("dirtyrects");
+    if (dirty_rects && (automaton_memory != "global" || schedule != "jacobi" || packed_storage)) {
+        std::cout << TERM_RED <<
+            "WARNING: dirty rectangles (--dirtyrects) are only available with the global automaton, jacobi schedule and unpacked storage. Ignoring them" <<
+            TERM_RESET << std::endl;
+        dirty_rects = false;
+    }
+    if (dirty_rects && warm_start) {
+        std::cout << TERM_RED <<
+            "WARNING: dirty rectangles (--dirtyrects) and warm start (--warmstart) can't be combined. Ignoring warm start" <<
+            TERM_RESET << std::endl;
+        warm_start = false;
+    }
+    int dirty_margin = result["dirtymargin"].as<int>();
+    if (dirty_margin < 1) {
+        std::cout << TERM_RED <<
+            "WARNING: provided dirty rectangle margin argument (--dirtymargin) invalid. Falling back to 1" <<
+            TERM_RESET << std::endl;
+        dirty_margin = 1;
+    }
+    bool multidevice = result.count("multidevice");
+    if (multidevice && (automaton_memory != "global" || schedule != "jacobi" || packed_storage ||
+        warm_start || dirty_rects)) {
+        std::cout << TERM_RED <<
+            "WARNING: multi-device (--multidevice) is only available with the global automaton, jacobi schedule and unpacked storage, without warm start or dirty rectangles. Ignoring it" <<
+            TERM_RESET << std::endl;
+        multidevice = false;
+    }
+    int subdevices = result["subdevices"].as<int>();
+    int exchange_interval = result["exchangeinterval"].as<int>();
+    if (exchange_interval < 1) {
+        std::cout << TERM_RED <<
+            "WARNING: provided exchange interval argument (--exchangeinterval) invalid. Falling back to 1" <<
+            TERM_RESET << std::endl;
+        exchange_interval = 1;
+    }
+    int tile_size = result["tilesize"].as<int>();
+    if (tile_size < 1) {
+        std::cout << TERM_RED <<
+            "WARNING: provided tile size argument (--tilesize) invalid. Falling back to 1024" <<
+            TERM_RESET << std::endl;
+        tile_size = 1024;
+    }
+    int uf_lookahead = result["uflookahead"].as<int>();
+    if (uf_lookahead < 0) {
+        std::cout << TERM_RED <<
+            "WARNING: provided union-find lookahead argument (--uflookahead) invalid. Falling back to 32" <<
+            TERM_RESET << std::endl;
+        uf_lookahead = 32;
+    }
+    if (backend != "opencl" && (automaton_memory != "global" || schedule != "jacobi" || packed_storage ||
+        warm_start || dirty_rects || multidevice)) {
+        std::cout << TERM_RED <<
+            "WARNING: the " << backend << " backend (--backend) runs the global automaton with the jacobi schedule and unpacked storage (or its equivalent), without warm start, dirty rectangles or multi-device. Ignoring the other options" <<
+            TERM_RESET << std::endl;
+        automaton_memory = "global";
+        schedule = "jacobi";
+        packed_storage = false;
+        warm_start = false;
+        dirty_rects = false;
+        multidevice = false;
+    }
+    // the tiled automaton runs on the host most of the time, nothing to overlap
+    bool pipeline = !result.count("nopipeline") && (result.count("batch") || stream) &&
+        automaton_memory != "tiled" && backend == "opencl";
+    int raw_width = 0;
+    int raw_height = 0;
+    if (result.count("rawsize")) {
+        std::string rawsize = result["rawsize"].as<std::string>();
+        size_t x = rawsize.find('x');
+        if (x != std::string::npos) {
+            raw_width = atoi(rawsize.substr(0, x).c_str());
+            raw_height = atoi(rawsize.substr(x+1).c_str());
+        }
+        if (raw_width <= 0 || raw_height <= 0) {
+            std::cerr << TERM_RED << "Error: invalid raw frame size (--rawsize), expected WIDTHxHEIGHT" << TERM_RESET << std::endl;
+            exit(1);
+        }
+    }
+    std::string program_cache_dir = result["cachedir"].as<std::string>();
+    bool use_program_cache = !result.count("nocache") && !program_cache_dir.empty();
+    std::string arrow_source = result["arrowsource"].as<std::string>();
+    if (arrow_source != "luma" && arrow_source != "gradient") {
+        std::cout << TERM_RED <<
+            "WARNING: provided arrow source argument (--arrowsource) invalid. Falling back to luma" <<
+            TERM_RESET << std::endl;
+        arrow_source = "luma";
+    }
+
+    if (enable_profiling) std::cout << TERM_CYAN <<
+        "Running with profiling enabled" << TERM_RESET << std::endl;
+
+    WATERSHED_OPTIONS opts;
+    opts.backend = backend;
+    opts.threads = cpu_thread_count(threads);
+    opts.cpu_simd = !result.count("nosimd");
+    opts.cpu_schedule = cpu_schedule;
+    opts.cpu_scaling = result.count("scaling");
+    opts.automaton_memory = automaton_memory;
+    opts.schedule = schedule;
+    opts.arrow_source = arrow_source;
+    opts.lws_cli = lws_cli;
+    opts.sync_interval = sync_interval;
+    opts.temporal_steps_cli = temporal_steps_cli;
+    opts.packed_storage = packed_storage;
+    opts.jit_specialize = jit_specialize;
+    opts.enable_profiling = enable_profiling;
+    opts.warm_start = warm_start;
+    opts.warm_threshold = warm_threshold;
+    opts.dirty_rects = dirty_rects;
+    opts.dirty_margin = dirty_margin;
+    opts.multidevice = multidevice;
+    opts.exchange_interval = exchange_interval;
+    opts.tile_size = tile_size;
+    opts.uf_lookahead = uf_lookahead;
+
+    WATERSHED_ENV env;
+    if (backend == "opencl") {
+        env.device = ocl_get_default_device(selectplatform);
+        if (automaton_memory == "inplace" && !ocl_has_int64_atomics(env.device)) {
+            // without 64 bit atomics the packed cost and label could be read torn
+            std::cerr << TERM_RED <<
+                "Error: the in place automaton (-a inplace) needs cl_khr_int64_extended_atomics, which the device lacks" <<
+                TERM_RESET << std::endl;
+            exit(1);
+        }
+        env.context = cl::Context({env.device});
+        if (enable_profiling) env.queue = cl::CommandQueue(env.context, env.device, CL_QUEUE_PROFILING_ENABLE);
+        else env.queue = cl::CommandQueue(env.context, env.device);
+        if (pipeline) {
+            env.upload_queue = cl::CommandQueue(env.context, env.device);
+            env.download_queue = cl::CommandQueue(env.context, env.device);
+        }
+        else {
+            env.upload_queue = env.queue;
+            env.download_queue = env.queue;
+        }
+    }
+    init_program_cache(env.program_cache, use_program_cache ? program_cache_dir : "");
+    init_device_pool(env.pool);
+    init_tiled_engine(env.tiles, tile_size);
+    if (multidevice) {
+        init_strip_devices(env.strips, ocl_get_all_devices(selectplatform, subdevices),
+            use_program_cache ? program_cache_dir : "");
+    }
+
+    if (stream) {
+        bool raw = raw_width > 0;
+        FRAME_SOURCE stream_source = [&](FRAME& frame) {
+            frame.in_path = "stdin";
+            BMPVEC bmp;
+            if (raw) {
+                frame.width = raw_width;
+                frame.height = raw_height;
+                if (!read_raw_frame(stdin, bmp, raw_width, raw_height)) return false;
+            }
+            else if (!read_ppm_frame(stdin, bmp, frame.width, frame.height)) return false;
+            bgr2bgra(bmp, frame.rgba);
+            return true;
+        };
+        FRAME_SINK stream_sink = [&](FRAME& frame) {
+            std::vector<uint8_t> rgb_outimage((size_t)frame.width*frame.height*3);
+            rgba2rgb(&frame.output_rgba[0], (size_t)frame.width*frame.height, &rgb_outimage[0]);
+            write_frame(stdout, &rgb_outimage[0], frame.width, frame.height, !raw);
+        };
+
+        double stream_megapixels = 0;
+        size_t stream_frames = 0;
+        auto stream_start = std::chrono::high_resolution_clock::now();
+        if (pipeline) {
+            run_pipeline(env, opts, stream_source, stream_sink, 0, stream_megapixels, stream_frames);
+        }
+        else {
+            FRAME frame;
+            frame.slot = 0;
+            while (stream_source(frame)) {
+                process_frame(env, opts, frame);
+                stream_sink(frame);
+                stream_megapixels += (double)frame.width*frame.height / 1e6;
+                stream_frames++;
+            }
+        }
+        double stream_time = std::chrono::duration<double>(
+            std::chrono::high_resolution_clock::now() - stream_start).count();
+
+        std::cout << TERM_BOLD << TERM_GREEN <<
+            "Stream: " << stream_frames << " frames in " << stream_time << " s, " <<
+            stream_frames/stream_time << " frames/s, " <<
+            stream_megapixels/stream_time << " MP/s" <<
+            TERM_RESET << std::endl;
+        print_program_cache_stats(env.program_cache);
+        return 0;
+    }
+
+    if (batch_path.empty()) {
+        process_image(env, opts, bmp_path, out_path);
+        print_program_cache_stats(env.program_cache);
+        return 0;
+    }
+
+    std::vector<std::string> batch_inputs = list_batch_inputs(batch_path);
+    std::string out_dir = result["outdir"].as<std::string>();
+    if (batch_inputs.empty()) {
+        std::cerr << TERM_RED << "Error: no input images in " << batch_path << TERM_RESET << std::endl;
+        exit(1);
+    }
+
+    double batch_megapixels = 0;
+    auto batch_start = std::chrono::high_resolution_clock::now();
+    if (pipeline) {
+        size_t next_input = 0;
+        size_t batch_frames = 0;
+        FRAME_SOURCE batch_source = [&](FRAME& frame) {
+            if (next_input == batch_inputs.size()) return false;
+            frame.in_path = batch_inputs[next_input];
+            frame.out_path = out_dir + "/" + get_stem(batch_inputs[next_input]) + "_out.ppm";
+            next_input++;
+            decode_frame(frame);
+            return true;
+        };
+        run_pipeline(env, opts, batch_source, encode_frame, batch_inputs.size(), batch_megapixels, batch_frames);
+    }
+    else for (size_t i=0; i<batch_inputs.size(); i++) {
+        auto image_start = std::chrono::high_resolution_clock::now();
+        double megapixels = process_image(env, opts, batch_inputs[i], out_dir + "/" + get_stem(batch_inputs[i]) + "_out.ppm");
+        double image_time = std::chrono::duration<double>(
+            std::chrono::high_resolution_clock::now() - image_start).count();
+
+        batch_megapixels += megapixels;
+        std::cout << TERM_CYAN <<
+            "Image " << i+1 << "/" << batch_inputs.size() << ": " <<
+            image_time*1000 << " ms, " <<
+            1/image_time << " images/s, " <<
+            megapixels/image_time << " MP/s" <<
+            TERM_RESET << std::endl;
+    }
+    double batch_time = std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - batch_start).count();
+
+    std::cout << TERM_BOLD << TERM_GREEN <<
+        "Batch: " << batch_inputs.size() << " images in " << batch_time << " s, " <<
+        batch_inputs.size()/batch_time << " images/s, " <<
+        batch_megapixels/batch_time << " MP/s" <<
+        TERM_RESET << std::endl;
+    std::cout << TERM_CYAN <<
+        "Device pool: " << env.pool.allocations << " allocations, " <<
+        env.pool.reuses << " reuses" <<
+        TERM_RESET << std::endl;
+    print_program_cache_stats(env.program_cache);
 
     return 0;
 }
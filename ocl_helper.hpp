@@ -2,17 +2,20 @@
 
 #include <CL/cl.hpp>
 #include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
 
-std::string read_kernel(std::string kernel_path) {
-    // Read the kernel file and return it as string;
-    std::ifstream sourceFile(kernel_path);
-    if (!sourceFile) {
-        std::cerr << TERM_RED << "Error: Could not find kernel source for path " << kernel_path << std::endl << TERM_RESET;
-        exit(1);
-    }
-    std::string sourceCode((std::istreambuf_iterator<char>(sourceFile)), (std::istreambuf_iterator<char>()));
-    sourceFile.close();
-    return sourceCode;
+bool ocl_platforms_available() {
+    // with no OpenCL runtime installed the ICD loader reports no platforms
+    std::vector<cl::Platform> all_platforms;
+    cl::Platform::get(&all_platforms);
+    return !all_platforms.empty();
+}
+
+bool ocl_has_int64_atomics(cl::Device &device) {
+    // 64 bit atom_min and friends, needed to update packed lattices in place
+    return device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_int64_extended_atomics") != std::string::npos;
 }
 
 cl::Device ocl_get_default_device(int selectplatform=0) {
@@ -63,6 +66,55 @@ cl::Device ocl_get_default_device(int selectplatform=0) {
     return default_device;
 }
 
+std::vector<cl::Device> ocl_get_all_devices(int selectplatform=0, int subdevices=0) {
+    // every device of every platform, or with subdevices the first device of
+    // the selected platform partitioned into that many sub-devices
+    std::vector<cl::Device> devices;
+
+    if (subdevices > 0) {
+        cl::Device parent = ocl_get_default_device(selectplatform);
+        cl_uint compute_units = parent.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        cl_device_partition_property properties[] = {
+            CL_DEVICE_PARTITION_EQUALLY,
+            (cl_device_partition_property)std::max(compute_units/subdevices, (cl_uint)1),
+            0
+        };
+        cl_int err = parent.createSubDevices(properties, &devices);
+        cl_check(err, "Creating sub-devices");
+        if ((int)devices.size() > subdevices) devices.resize(subdevices);
+        std::cout << "Partitioned " << TERM_BOLD << parent.getInfo<CL_DEVICE_NAME>() << TERM_RESET <<
+            " into " << devices.size() << " sub-devices" << std::endl;
+        return devices;
+    }
+
+    std::vector<cl::Platform> all_platforms;
+    cl::Platform::get(&all_platforms);
+    for (size_t i=0; i<all_platforms.size(); i++) {
+        std::vector<cl::Device> platform_devices;
+        all_platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &platform_devices);
+        for (size_t j=0; j<platform_devices.size(); j++) {
+            std::cout << "Using device " << TERM_BOLD <<
+                platform_devices[j].getInfo<CL_DEVICE_NAME>() << TERM_RESET <<
+                " (" << all_platforms[i].getInfo<CL_PLATFORM_NAME>() << ")" << std::endl;
+            devices.push_back(platform_devices[j]);
+        }
+    }
+    if (devices.empty()) {
+        std::cerr << "No devices found. Make sure OpenCL is installed correctly.\n";
+        exit(1);
+    }
+    return devices;
+}
+
+double get_event_time(const cl::Event &event) {
+    cl_ulong time_start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    cl_ulong time_end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    //std::cout << "\tDEBUG: "<< time_start << std::endl << "\t       " << time_end << std::endl;
+
+    double nanoseconds = time_end-time_start;
+    return nanoseconds/1000000.0;
+}
+
 double profile_kernel(
         cl::CommandQueue &queue,
         cl::Kernel &kernel,
@@ -83,12 +135,7 @@ double profile_kernel(
     queue.finish();
     cl_check(err, "Running automaton kernel ("+message+"\b\b)");
 
-    cl_ulong time_start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-    cl_ulong time_end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-    //std::cout << "\tDEBUG: "<< time_start << std::endl << "\t       " << time_end << std::endl;
-
-    double nanoseconds = time_end-time_start;
-    double milliseconds = nanoseconds/1000000.0;
+    double milliseconds = get_event_time(event);
 
 #if 0
     std::cout << TERM_CYAN <<
@@ -101,12 +148,20 @@ double profile_kernel(
     return milliseconds;
 }
 
+cl_ulong temporal_cache_size(int lws, int steps) {
+    // lattice and labels ping pong caches plus the luma cache, for a tile with a `steps` wide halo
+    cl_ulong cells = (lws+2*steps) * (lws+2*steps);
+    return sizeof(cl_uint) * 5 * cells;
+}
+
 cl_int round_up(int x, int y) {
     return ((x + y - 1) / y) * y;
 }
 
-float get_memory_throughput_global(int w, int h, float exec_time, bool print=true) {
-    float bytes = 10*w*h*4; // 8wh bytes (read) + 2wh bytes (write)
+float get_memory_throughput_global(int w, int h, float exec_time, bool print=true, int bytes_per_pixel=10*4) {
+    // 10 variables of 4 bytes per pixel: 8 reads + 2 writes.
+    // The packed layout does 5 reads + 1 write of 8 bytes (6*8)
+    float bytes = (float)bytes_per_pixel*w*h;
     //float throughput = (bytes*1000.0)/exec_time; // *1000 is to get bytes/sec
     float throughput = bytes/(exec_time*1000.0); // *1000 in the denominator is to get MEGAbytes/sec
     if (print) {
@@ -127,3 +182,160 @@ float get_memory_throughput_local(int w, int h, float exec_time, int lws, bool p
     }
     return throughput;
 }
+
+cl_int enqueue_kernel(
+        cl::CommandQueue &queue,
+        cl::Kernel &kernel,
+        cl::NDRange offset,
+        cl::NDRange global,
+        cl::NDRange local,
+        std::vector<cl::Event>* events,
+        std::string message="") {
+    // Non blocking launch; when events is not NULL the launch event is
+    // appended to it so that it can be profiled later
+    cl::Event event;
+    cl_int err = queue.enqueueNDRangeKernel(
+                kernel,
+                offset,
+                global,
+                local,
+                NULL,
+                events ? &event : NULL);
+    cl_check(err, message);
+    if (events) events->push_back(event);
+    return err;
+}
+
+typedef struct tagAUTOMATON_STATS {
+    int steps;          // automaton steps executed (including the last, unchanged one)
+    int relaxations;    // relaxation steps, launches can group more than one per step
+    int launches;       // kernel launches enqueued
+    int sync_points;    // times the host blocked waiting for the device
+    bool converged;
+    double kernel_time; // ms, only measured with profiling enabled
+    double wall_time;   // ms, host side
+} AUTOMATON_STATS;
+
+/*
+    Enqueues a single automaton step: binds the current buffers, launches
+    the kernel(s) writing the convergence flag in are_diff and swaps the
+    buffers for the next step. Returns the number of launches enqueued.
+ */
+typedef std::function<int(cl::Buffer& are_diff, std::vector<cl::Event>* events)> AUTOMATON_STEP_FN;
+
+/*
+    Runs up to max_steps automaton steps, enqueueing sync_interval steps
+    back to back before waiting for the device. Every step of a batch gets
+    its own flag buffer, reset on the device with enqueueFillBuffer and read
+    back with non blocking reads, so the host only waits once per batch, on
+    the event of the last read.
+    Steps enqueued after convergence don't change the lattice (the state
+    is a fixed point), so overshooting the last batch is harmless.
+    relaxations_per_step is the number of relaxation steps each enqueued
+    step performs (e.g. temporal blocking kernels), used for reporting.
+    Callers running many short loops can pass their own flag buffers,
+    kept between calls (grown to sync_interval when needed), and silence
+    the convergence message with print=false.
+ */
+AUTOMATON_STATS run_automaton_loop(
+        cl::Context &context,
+        cl::CommandQueue &queue,
+        int max_steps,
+        int sync_interval,
+        int relaxations_per_step,
+        bool profiling,
+        AUTOMATON_STEP_FN enqueue_step,
+        bool print=true,
+        std::vector<cl::Buffer>* flags=NULL) {
+
+    AUTOMATON_STATS stats = {0, 0, 0, 0, false, 0, 0};
+    cl_int err;
+
+    if (sync_interval < 1) sync_interval = 1;
+
+    std::vector<cl::Buffer> local_flags;
+    std::vector<cl::Buffer> &cl_flags = flags ? *flags : local_flags;
+    while ((int)cl_flags.size() < sync_interval) {
+        cl_flags.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err));
+        cl_check(err, "Creating are_diff value buffer");
+    }
+    std::vector<cl_uint> host_flags(sync_interval, 0u);
+    std::vector<cl::Event> events;
+
+    auto wall_start = std::chrono::steady_clock::now();
+
+    while (stats.steps < max_steps && !stats.converged) {
+        int batch = std::min(sync_interval, max_steps - stats.steps);
+
+        for (int k=0; k<batch; k++) {
+            err = queue.enqueueFillBuffer(cl_flags[k], (cl_uint)0, 0, sizeof(cl_uint));
+            cl_check(err, "Resetting are_diff value buffer");
+            stats.launches += enqueue_step(cl_flags[k], profiling ? &events : NULL);
+        }
+
+        cl::Event read_done;
+        for (int k=0; k<batch; k++) {
+            err = queue.enqueueReadBuffer(
+                        cl_flags[k],
+                        CL_FALSE,
+                        0,
+                        sizeof(cl_uint),
+                        &host_flags[k],
+                        NULL,
+                        k == batch-1 ? &read_done : NULL);
+            cl_check(err, "Reading are_diff value buffer");
+        }
+        // in order queue: the last read completing means the whole batch is done
+        read_done.wait();
+        stats.sync_points++;
+
+        for (int k=0; k<batch; k++) {
+            if (!host_flags[k]) {
+                stats.steps += k+1;
+                stats.converged = true;
+                break;
+            }
+        }
+        if (!stats.converged) stats.steps += batch;
+    }
+
+    stats.relaxations = stats.steps*relaxations_per_step;
+
+    auto wall_end = std::chrono::steady_clock::now();
+    stats.wall_time = std::chrono::duration<double, std::milli>(wall_end - wall_start).count();
+
+    for (size_t e=0; e<events.size(); e++) {
+        stats.kernel_time += get_event_time(events[e]);
+    }
+
+    if (stats.converged && print) {
+        std::cout << TERM_CYAN <<
+            "Baling out early from automaton loop at step #" << stats.steps-1;
+        if (relaxations_per_step > 1) std::cout <<
+            " (relaxation step #" << stats.relaxations-1 << ")";
+        std::cout << std::endl << TERM_RESET;
+    }
+
+    return stats;
+}
+
+void print_automaton_stats(AUTOMATON_STATS stats, int sync_interval) {
+    std::cout << TERM_GREEN << "Total automaton time: " <<
+        std::setprecision(5) <<
+        stats.kernel_time << "ms" << std::endl <<
+        "Mean automaton time: " <<
+        stats.kernel_time/(double)stats.launches << "ms" <<
+        TERM_RESET << std::endl;
+
+    // The unbatched loop blocks three times per step: flag upload, kernel and flag readback
+    int unbatched_sync_points = 3*stats.steps;
+    std::cout << TERM_GREEN << "Sync interval: " << sync_interval <<
+        " (" << stats.launches << " launches, " << stats.steps << " steps, " <<
+        stats.relaxations << " relaxation steps)" << std::endl <<
+        "Host sync points: " << stats.sync_points <<
+        " (unbatched: " << unbatched_sync_points <<
+        ", saved: " << unbatched_sync_points - stats.sync_points << ")" << std::endl <<
+        "Host wall time: " << stats.wall_time << "ms" <<
+        " (sync and launch overhead: " << std::max(0.0, stats.wall_time - stats.kernel_time) << "ms)" <<
+        TERM_RESET << std::endl;
+}
@@ -1,4 +1,7 @@
 #pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#ifdef cl_khr_int64_extended_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
+#endif
 
 constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
 
@@ -8,6 +11,60 @@ constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_
 #define MAX_INT UINT_MAX
 #define LAPLACIAN 0
 
+/*
+    Specialization: the host can bake the image geometry and the local work
+    size in at build time (-DWIDTH=... -DHEIGHT=... -DLWS_X=... -DCONNECTIVITY=...)
+    so that the compiler can fold the index and bounds arithmetic.
+    Without them the kernels fall back to their runtime arguments, which are
+    still passed in both cases.
+ */
+#ifdef WIDTH
+#define IMG_WIDTH WIDTH
+#else
+#define IMG_WIDTH width
+#endif
+
+#ifdef HEIGHT
+#define IMG_HEIGHT HEIGHT
+#else
+#define IMG_HEIGHT height
+#endif
+
+// local work sizes are square
+#ifdef LWS_X
+#define LOCAL_SIZE_0 LWS_X
+#define LOCAL_SIZE_1 LWS_X
+#else
+#define LOCAL_SIZE_0 get_local_size(0)
+#define LOCAL_SIZE_1 get_local_size(1)
+#endif
+
+/*
+    Kernel subsets: the host builds one program per automaton, defining
+    MODE_<AUTOMATON> so that only the kernels of that automaton get compiled.
+    Without any MODE_ macro every kernel is built.
+ */
+#if !defined(MODE_GLOBAL) && !defined(MODE_LOCAL) && !defined(MODE_IMAGE) && \
+    !defined(MODE_PERSISTENT) && !defined(MODE_UNIONFIND) && !defined(MODE_ARROWS) && \
+    !defined(MODE_FRONTIER) && !defined(MODE_INPLACE) && !defined(MODE_TILED)
+#define MODE_GLOBAL
+#define MODE_LOCAL
+#define MODE_IMAGE
+#define MODE_PERSISTENT
+#define MODE_UNIONFIND
+#define MODE_ARROWS
+#define MODE_FRONTIER
+#define MODE_INPLACE
+#define MODE_TILED
+#endif
+
+#ifndef CONNECTIVITY
+#define CONNECTIVITY 4
+#endif
+#if CONNECTIVITY != 4
+#error "Only 4-connectivity is implemented"
+#endif
+
 //void kernel init_globals(global uint* minima_value) {
 //    *minima_value=255u;
 //}
@@ -62,6 +119,7 @@ void kernel make_gradient(
 
 }
 
+#if defined(MODE_GLOBAL) || defined(MODE_LOCAL) || defined(MODE_PERSISTENT) || defined(MODE_FRONTIER)
 void kernel init_t0(
     global uint* t0_lattice,
     global uint* t0_labels,
@@ -69,11 +127,158 @@ void kernel init_t0(
     read_only image2d_t gradient_pic) {
 
     uint pixval = read_imageui(gradient_pic, (int2){get_global_id(0), get_global_id(1)}).x;
-    uint pos = get_global_id(0)+(get_global_id(1)*width);
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
     t0_lattice[pos] = pixval == 0 ? (uint)0 : (uint)MAX_INT;
     t0_labels[pos] = pixval == 0 ? (uint)pos : (uint)0;
 }
 
+/*
+    Warm start from the previous frame's converged state.
+    A pixel's cost comes from a chain of neighbors that all carry its label,
+    so only the basins containing a changed pixel can hold stale costs.
+    A pixel changed if its luma moved more than the threshold or it gained
+    or lost its seed status; its basin gets invalidated as a whole, the rest
+    of the lattice is kept and the automaton only has to repair the holes.
+ */
+void kernel warm_mark_changed(
+    read_only image2d_t luma_pic,
+    read_only image2d_t prev_luma_pic,
+    read_only image2d_t gradient_pic,
+    read_only image2d_t prev_gradient_pic,
+    int width,
+    global const uint* prev_labels,
+    uint threshold,
+    global uint* label_dirty) {
+
+    const int2 pos = (int2){get_global_id(0), get_global_id(1)};
+    const uint linearpos = pos.x + pos.y*IMG_WIDTH;
+
+    int luma = read_imageui(luma_pic, pos).x;
+    int prev_luma = read_imageui(prev_luma_pic, pos).x;
+    bool seed = read_imageui(gradient_pic, pos).x == 0;
+    bool prev_seed = read_imageui(prev_gradient_pic, pos).x == 0;
+
+    if (abs(luma - prev_luma) > threshold || seed != prev_seed) label_dirty[prev_labels[linearpos]] = 1;
+}
+
+void kernel warm_init_t0(
+    global const uint* prev_lattice,
+    global const uint* prev_labels,
+    global const uint* label_dirty,
+    int width,
+    read_only image2d_t gradient_pic,
+    global uint* t0_lattice,
+    global uint* t0_labels) {
+
+    uint pixval = read_imageui(gradient_pic, (int2){get_global_id(0), get_global_id(1)}).x;
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    uint label = prev_labels[pos];
+
+    if (pixval == 0) {
+        t0_lattice[pos] = 0;
+        t0_labels[pos] = pos;
+    }
+    else if (label_dirty[label]) {
+        t0_lattice[pos] = MAX_INT;
+        t0_labels[pos] = 0;
+    }
+    else {
+        t0_lattice[pos] = prev_lattice[pos];
+        t0_labels[pos] = label;
+    }
+}
+
+/*
+    Dirty rectangles reuse the warm start's per basin invalidation: every
+    basin with a pixel in a changed region (region is its index) is marked
+    with region+1, and the region grows to the bounding box of the basins
+    it marked, so that warm_init_t0 over the grown regions resets each of
+    them whole. bounds holds x0, y0, x1, y1 per region, starting from the
+    region itself.
+ */
+void kernel dirty_mark_labels(
+    global const uint* prev_labels,
+    int width,
+    uint region,
+    global uint* label_dirty) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    label_dirty[prev_labels[pos]] = region+1;
+}
+
+void kernel dirty_basin_bounds(
+    global const uint* prev_labels,
+    int width,
+    int height,
+    global const uint* label_dirty,
+    global int* bounds) {
+
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if (x >= IMG_WIDTH || y >= IMG_HEIGHT) return; // the global work sizes can be bigger than the image sizes
+
+    uint region = label_dirty[prev_labels[x+y*IMG_WIDTH]];
+    if (region == 0) return;
+    global int* box = bounds + 4*(region-1);
+    atomic_min(&box[0], x);
+    atomic_min(&box[1], y);
+    atomic_max(&box[2], x+1);
+    atomic_max(&box[3], y+1);
+}
+#endif
+
+#if defined(MODE_TILED)
+/*
+    Out of core tiles: the lattice lives on the host and a tile is uploaded
+    with a one pixel halo around it, the neighbor tiles' border (or MAX_INT
+    outside of the image, which never wins). Launched over the interior,
+    with a (1, 1) offset; the halo is never written. Labels are positions in
+    the whole image, they're only copied around.
+    Same update and tie breaking as automaton_global.
+ */
+void kernel automaton_tile(
+    global const uchar* luma,
+    int tile_width, // halo included
+    global const uint* t0_lattice,
+    global const uint* t0_labels,
+    global uint* t1_lattice,
+    global uint* t1_labels,
+    global uint* are_diff) {
+
+    uint pos = get_global_id(0) + get_global_id(1)*tile_width;
+    uint t0_lattice_pos = t0_lattice[pos];
+    uint pixel = luma[pos];
+
+    // x: north, y: east, z: south, w: west
+    uint4 neib_pos = (uint4){pos-tile_width, pos+1, pos+tile_width, pos-1};
+
+    uint2 u_t = (uint2){t0_lattice_pos, pos};
+
+    uint4 ut_cand = (uint4){
+        add_sat(t0_lattice[neib_pos.x], pixel),
+        add_sat(t0_lattice[neib_pos.y], pixel),
+        add_sat(t0_lattice[neib_pos.z], pixel),
+        add_sat(t0_lattice[neib_pos.w], pixel),
+    };
+
+    u_t = u_t.x > ut_cand.x ? (uint2){ut_cand.x, neib_pos.x} : u_t;
+    u_t = u_t.x > ut_cand.y ? (uint2){ut_cand.y, neib_pos.y} : u_t;
+    u_t = u_t.x > ut_cand.z ? (uint2){ut_cand.z, neib_pos.z} : u_t;
+    u_t = u_t.x > ut_cand.w ? (uint2){ut_cand.w, neib_pos.w} : u_t;
+
+    t1_lattice[pos] = u_t.x;
+
+    uint newlabel = t0_labels[u_t.y];
+    t1_labels[pos] = newlabel;
+
+    if (
+        t0_lattice_pos != u_t.x ||
+        t0_labels[pos] != newlabel
+    ) are_diff[0] = 1;
+}
+#endif
+
+#if defined(MODE_IMAGE)
 void kernel init_t0_image(
     write_only image2d_t t0_lattice,
     write_only image2d_t t0_labels,
@@ -82,11 +287,13 @@ void kernel init_t0_image(
 
     uint pixval = read_imageui(gradient_pic, (int2){get_global_id(0), get_global_id(1)}).x;
     int2 pos = {get_global_id(0), get_global_id(1)};
-    uint linearpos = get_global_id(0)+(get_global_id(1)*width);
+    uint linearpos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
     write_imageui(t0_lattice, pos, pixval == 0 ? (uint)0 : (uint)MAX_INT);
     write_imageui(t0_labels, pos, pixval == 0 ? (uint)linearpos : (uint)0);
 }
+#endif
 
+#if defined(MODE_GLOBAL)
 void kernel automaton_global(
     read_only image2d_t luma_pic, // this contains the values for f(p)
     int width,
@@ -97,18 +304,18 @@ void kernel automaton_global(
     global uint* t1_labels,
     global uint* are_diff) {
 
-    uint pos = get_global_id(0)+(get_global_id(1)*width);
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
 
-    const int iamoutofbound = get_global_id(0) >= width || get_global_id(1) >= height;
+    const int iamoutofbound = get_global_id(0) >= IMG_WIDTH || get_global_id(1) >= IMG_HEIGHT;
     if (iamoutofbound) return; // failsafe (the global work sizes can be bigger than the image sizes)
     // x: north, y: east, z: south, t: west
 
     uint t0_lattice_pos = t0_lattice[pos];
 
     uint4 neib_pos = (uint4){
-        get_global_id(1) != 0 ? pos-width : pos, // exists if it's not the first row
-        get_global_id(0) != (width-1) ? pos+1 : pos, // exists if it's not the last column
-        get_global_id(1) != (height-1) ? pos+width : pos, // exists if it's not the last row
+        get_global_id(1) != 0 ? pos-IMG_WIDTH : pos, // exists if it's not the first row
+        get_global_id(0) != (IMG_WIDTH-1) ? pos+1 : pos, // exists if it's not the last column
+        get_global_id(1) != (IMG_HEIGHT-1) ? pos+IMG_WIDTH : pos, // exists if it's not the last row
         get_global_id(0) != 0 ? pos-1 : pos, //exists if it's not the first column
     };
 
@@ -144,7 +351,149 @@ void kernel automaton_global(
         t0_labels[pos] != newlabel
     ) are_diff[0] = 1;
 }
+#endif
+
+#if defined(MODE_GLOBAL) || defined(MODE_INPLACE)
+/*
+    Packed lattice+labels storage: one uint2 per pixel, with the label in x
+    and the lattice value in y. Read as a (little endian) ulong this is
+    lattice<<32 | label, so comparing the packed values orders them by cost
+    first, which is what the in place automaton relies on.
+    Every neighbor read is a single 8 byte load instead of two 4 byte ones.
+ */
+void kernel init_t0_packed(
+    global uint2* t0_packed,
+    int width,
+    read_only image2d_t gradient_pic) {
+
+    uint pixval = read_imageui(gradient_pic, (int2){get_global_id(0), get_global_id(1)}).x;
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    t0_packed[pos] = pixval == 0 ? (uint2){pos, 0} : (uint2){0, MAX_INT};
+}
+
+void kernel unpack_labels(
+    global const uint2* packed,
+    int width,
+    global uint* labels) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    labels[pos] = packed[pos].x;
+}
+#endif
+
+#if defined(MODE_GLOBAL)
+void kernel automaton_global_packed(
+    read_only image2d_t luma_pic, // this contains the values for f(p)
+    int width,
+    int height,
+    global const uint2* t0_packed,
+    global uint2* t1_packed,
+    global uint* are_diff) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+
+    const int iamoutofbound = get_global_id(0) >= IMG_WIDTH || get_global_id(1) >= IMG_HEIGHT;
+    if (iamoutofbound) return; // failsafe (the global work sizes can be bigger than the image sizes)
+    // x: north, y: east, z: south, t: west
+
+    uint2 t0_pos = t0_packed[pos];
+
+    uint4 neib_pos = (uint4){
+        get_global_id(1) != 0 ? pos-IMG_WIDTH : pos, // exists if it's not the first row
+        get_global_id(0) != (IMG_WIDTH-1) ? pos+1 : pos, // exists if it's not the last column
+        get_global_id(1) != (IMG_HEIGHT-1) ? pos+IMG_WIDTH : pos, // exists if it's not the last row
+        get_global_id(0) != 0 ? pos-1 : pos, //exists if it's not the first column
+    };
+
+    uint2 neib_n = t0_packed[neib_pos.x];
+    uint2 neib_e = t0_packed[neib_pos.y];
+    uint2 neib_s = t0_packed[neib_pos.z];
+    uint2 neib_w = t0_packed[neib_pos.w];
+
+    uint pixel = read_imageui(luma_pic, (int2){get_global_id(0), get_global_id(1)}).x;
+
+    // (label, lattice), as in the packed layout
+    uint2 u_t = t0_pos;
+
+    // possible u_t candidates
+    uint4 ut_cand = (uint4){
+        add_sat(neib_n.y, pixel),
+        add_sat(neib_e.y, pixel),
+        add_sat(neib_s.y, pixel),
+        add_sat(neib_w.y, pixel),
+    };
+
+    ut_cand = select(ut_cand, (uint4)MAX_INT, ((uint4)pos == neib_pos));
+
+    u_t = u_t.y > ut_cand.x ? (uint2){neib_n.x, ut_cand.x} : u_t;
+    u_t = u_t.y > ut_cand.y ? (uint2){neib_e.x, ut_cand.y} : u_t;
+    u_t = u_t.y > ut_cand.z ? (uint2){neib_s.x, ut_cand.z} : u_t;
+    u_t = u_t.y > ut_cand.w ? (uint2){neib_w.x, ut_cand.w} : u_t;
+
+    t1_packed[pos] = u_t;
+
+    if (any(t0_pos != u_t)) are_diff[0] = 1;
+}
+#endif
+
 
+#if defined(MODE_INPLACE)
+/*
+    In place (chaotic relaxation) automaton on a single packed buffer, see
+    init_t0_packed for the layout. Every pixel reads the newest values of its
+    neighbors, so labels can travel more than one pixel per launch.
+    Candidates are compared as packed ulongs (cost first, then label), which
+    makes the fixed point independent of the update order: the result is
+    deterministic, but ties go to the lowest label instead of the first
+    neighbor in north, east, south, west order like the Jacobi kernels.
+    Values only ever decrease, so a launch that changes nothing means that
+    the lattice is a fixed point and the bail out check stays valid.
+    Every access is atomic so that cost and label are never read torn; the
+    host refuses this automaton on devices without 64 bit atomics.
+ */
+#ifdef cl_khr_int64_extended_atomics
+void kernel automaton_inplace(
+    read_only image2d_t luma_pic, // this contains the values for f(p)
+    int width,
+    int height,
+    global ulong* lattice,
+    global uint* are_diff) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+
+    const int iamoutofbound = get_global_id(0) >= IMG_WIDTH || get_global_id(1) >= IMG_HEIGHT;
+    if (iamoutofbound) return; // failsafe (the global work sizes can be bigger than the image sizes)
+
+    uint4 neib_pos = (uint4){
+        get_global_id(1) != 0 ? pos-IMG_WIDTH : pos, // exists if it's not the first row
+        get_global_id(0) != (IMG_WIDTH-1) ? pos+1 : pos, // exists if it's not the last column
+        get_global_id(1) != (IMG_HEIGHT-1) ? pos+IMG_WIDTH : pos, // exists if it's not the last row
+        get_global_id(0) != 0 ? pos-1 : pos, //exists if it's not the first column
+    };
+
+    uint pixel = read_imageui(luma_pic, (int2){get_global_id(0), get_global_id(1)}).x;
+
+    ulong own = atom_add(&lattice[pos], (ulong)0);
+    ulong u_t = own;
+
+    #pragma unroll
+    for (int i=0; i<4; i++) {
+        uint neib = i == 0 ? neib_pos.x : i == 1 ? neib_pos.y : i == 2 ? neib_pos.z : neib_pos.w;
+        if (neib == pos) continue; // border pixel
+        ulong neib_val = atom_add(&lattice[neib], (ulong)0);
+        ulong cand = ((ulong)add_sat((uint)(neib_val >> 32), pixel) << 32) | (neib_val & 0xFFFFFFFFul);
+        u_t = min(u_t, cand);
+    }
+
+    if (u_t >= own) return;
+
+    if (atom_min(&lattice[pos], u_t) > u_t) are_diff[0] = 1;
+}
+#endif
+#endif
+
+
+#if defined(MODE_LOCAL)
 void kernel automaton(
     read_only image2d_t luma_pic, // this contains the values for f(p)
     int width,
@@ -155,24 +504,50 @@ void kernel automaton(
     global uint* t1_labels,
     global uint* are_diff,
     local uint* cache_lattice,
-    local uint* cache_labels) {
+    local uint* cache_labels,
+    global const uint* prev_tile_changed, // per work group changed flags of the previous step
+    global uint* tile_changed) {
 
-    const uint pos = get_global_id(0)+(get_global_id(1)*width);
-    const uint img_size = width*height;
+    const uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    const uint img_size = IMG_WIDTH*IMG_HEIGHT;
     const size_t local_id0 = get_local_id(0);
     const size_t local_id1 = get_local_id(1);
-    const size_t lws0 = get_local_size(0);
-    const size_t lws1 = get_local_size(1);
+    const size_t lws0 = LOCAL_SIZE_0;
+    const size_t lws1 = LOCAL_SIZE_1;
     const size_t cache_height = lws1+2;
-    const int iamoutofbound = get_global_id(0) >= width || get_global_id(1) >= height;
+    const int iamoutofbound = get_global_id(0) >= IMG_WIDTH || get_global_id(1) >= IMG_HEIGHT;
+    const int i_am_the_first = local_id0 == 0 && local_id1 == 0;
+
+    // A tile can only change if itself or one of the 4 tiles its halo comes from
+    // changed in the previous step. If none did, both ping pong buffers already
+    // hold the same values for this tile, so there's nothing to load or write.
+    // The condition is the same for the whole group, so no barrier is skipped by half of it
+    const size_t group0 = get_group_id(0);
+    const size_t group1 = get_group_id(1);
+    const size_t groups0 = get_num_groups(0);
+    const size_t groups1 = get_num_groups(1);
+    const size_t group = group0 + group1*groups0;
+    if (
+        !prev_tile_changed[group] &&
+        (group1 == 0 || !prev_tile_changed[group-groups0]) &&
+        (group0 == groups0-1 || !prev_tile_changed[group+1]) &&
+        (group1 == groups1-1 || !prev_tile_changed[group+groups0]) &&
+        (group0 == 0 || !prev_tile_changed[group-1])
+    ) {
+        if (i_am_the_first) tile_changed[group] = 0;
+        return;
+    }
+
+    // the first work item is never out of bound, it clears the flag before the barrier below
+    if (i_am_the_first) tile_changed[group] = 0;
 
     if (iamoutofbound) return; // failsafe (the global work sizes can be bigger than the image sizes)
 
     // x: north, y: east, z: south, w: west
     uint4 neib_pos = (uint4){
-        get_global_id(1) != 0 ? pos-width : pos, // exists if it's not the first row
-        get_global_id(0) != (width-1) ? pos+1 : pos, // exists if it's not the last column
-        get_global_id(1) != (height-1) ? pos+width : pos, // exists if it's not the last row
+        get_global_id(1) != 0 ? pos-IMG_WIDTH : pos, // exists if it's not the first row
+        get_global_id(0) != (IMG_WIDTH-1) ? pos+1 : pos, // exists if it's not the last column
+        get_global_id(1) != (IMG_HEIGHT-1) ? pos+IMG_WIDTH : pos, // exists if it's not the last row
         get_global_id(0) != 0 ? pos-1 : pos //exists if it's not the first column
     };
 
@@ -242,7 +617,7 @@ void kernel automaton(
         cache_labels[local_neib_pos.w] = t0_labels[neib_pos.w];
     }
 
-    barrier(CLK_LOCAL_MEM_FENCE); // wait for all work items to finish caching
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE); // wait for all work items to finish caching
 
     //if (iamoutofbound) return;
 
@@ -281,10 +656,434 @@ void kernel automaton(
     if (
         cache_lattice[local_pos] != u_t.x || // equivalent to t1_lattice[pos] ||
         cache_labels[local_pos] != newlabel // equivalent to t1_labels[pos]
+    ) {
+        are_diff[0] = 1;
+        tile_changed[group] = 1;
+    }
+}
+
+
+/*
+    Temporal blocking version of the local memory automaton: the work group
+    caches its tile plus a halo of `steps` pixels on every side and runs
+    `steps` relaxation steps in local memory before writing the core back.
+    After s steps only the cells at distance >= s from the cache border are
+    still exact, so with a halo of `steps` pixels the core is identical to
+    `steps` launches of the one step kernels.
+    Pixels outside the image are cached with an infinite lattice value, so
+    they can never be chosen (equivalent to the select against border pixels).
+    The cache arrays hold two copies (ping pong) of
+    (lws0 + 2*steps) * (lws1 + 2*steps) cells each.
+ */
+void kernel automaton_temporal(
+    read_only image2d_t luma_pic, // this contains the values for f(p)
+    int width,
+    int height,
+    global const uint* t0_lattice,
+    global const uint* t0_labels,
+    global uint* t1_lattice,
+    global uint* t1_labels,
+    global uint* are_diff,
+    local uint* cache_lattice,
+    local uint* cache_labels,
+    local uint* cache_luma,
+    int steps) {
+
+    const int lws0 = LOCAL_SIZE_0;
+    const int lws1 = LOCAL_SIZE_1;
+    const int local_linear_id = get_local_id(0) + get_local_id(1)*lws0;
+    const int cache_width = lws0 + 2*steps;
+    const int cache_height = lws1 + 2*steps;
+    const int cache_size = cache_width*cache_height;
+    // global coordinates of the first cached cell (top left corner of the halo)
+    const int origin_x = get_group_id(0)*lws0 - steps;
+    const int origin_y = get_group_id(1)*lws1 - steps;
+
+    local uint* src_lattice = cache_lattice;
+    local uint* src_labels = cache_labels;
+    local uint* dst_lattice = cache_lattice + cache_size;
+    local uint* dst_labels = cache_labels + cache_size;
+
+    // every work item caches more than one cell, since the halo is wider than 1
+    for (int i=local_linear_id; i<cache_size; i+=lws0*lws1) {
+        int x = origin_x + i%cache_width;
+        int y = origin_y + i/cache_width;
+        int inside = x >= 0 && x < IMG_WIDTH && y >= 0 && y < IMG_HEIGHT;
+        int pos = x + y*IMG_WIDTH;
+        src_lattice[i] = inside ? t0_lattice[pos] : (uint)MAX_INT;
+        src_labels[i] = inside ? t0_labels[pos] : (uint)0;
+        cache_luma[i] = inside ? read_imageui(luma_pic, (int2){x, y}).x : (uint)0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE); // wait for all work items to finish caching
+
+    for (int s=0; s<steps; s++) {
+        for (int i=local_linear_id; i<cache_size; i+=lws0*lws1) {
+            int cx = i%cache_width;
+            int cy = i/cache_width;
+            int x = origin_x + cx;
+            int y = origin_y + cy;
+            // the outermost ring has no cached neighbors: it just becomes stale,
+            // which is fine as long as it stays out of the core's dependency cone
+            int updatable = cx > 0 && cx < cache_width-1 && cy > 0 && cy < cache_height-1 &&
+                x < IMG_WIDTH && y < IMG_HEIGHT && x >= 0 && y >= 0;
+
+            if (!updatable) {
+                dst_lattice[i] = src_lattice[i];
+                dst_labels[i] = src_labels[i];
+                continue;
+            }
+
+            // x: north, y: east, z: south, w: west
+            uint4 local_neib_pos = (uint4){
+                i-cache_width,
+                i+1,
+                i+cache_width,
+                i-1
+            };
+
+            uint pixel = cache_luma[i];
+
+            uint2 u_t=(uint2){
+                src_lattice[i],
+                i
+            };
+
+            // neighbors outside the image are cached as MAX_INT: add_sat keeps them there
+            uint4 ut_cand = (uint4){
+                add_sat(src_lattice[local_neib_pos.x], pixel),
+                add_sat(src_lattice[local_neib_pos.y], pixel),
+                add_sat(src_lattice[local_neib_pos.z], pixel),
+                add_sat(src_lattice[local_neib_pos.w], pixel),
+            };
+
+            u_t = u_t.x > ut_cand.x ? (uint2){ut_cand.x, local_neib_pos.x} : u_t;
+            u_t = u_t.x > ut_cand.y ? (uint2){ut_cand.y, local_neib_pos.y} : u_t;
+            u_t = u_t.x > ut_cand.z ? (uint2){ut_cand.z, local_neib_pos.z} : u_t;
+            u_t = u_t.x > ut_cand.w ? (uint2){ut_cand.w, local_neib_pos.w} : u_t;
+
+            dst_lattice[i] = u_t.x;
+            dst_labels[i] = src_labels[u_t.y];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE); // the whole step has to be done before the next one reads it
+
+        local uint* tmp = src_lattice;
+        src_lattice = dst_lattice;
+        dst_lattice = tmp;
+        tmp = src_labels;
+        src_labels = dst_labels;
+        dst_labels = tmp;
+    }
+
+    const int iamoutofbound = get_global_id(0) >= IMG_WIDTH || get_global_id(1) >= IMG_HEIGHT;
+    if (iamoutofbound) return; // no more barriers from here on
+
+    const uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    const int core_pos = (get_local_id(0)+steps) + (get_local_id(1)+steps)*cache_width;
+    uint newlattice = src_lattice[core_pos];
+    uint newlabel = src_labels[core_pos];
+
+    t1_lattice[pos] = newlattice;
+    t1_labels[pos] = newlabel;
+
+    if (
+        t0_lattice[pos] != newlattice ||
+        t0_labels[pos] != newlabel
     ) are_diff[0] = 1;
 }
+#endif
+
+
+#if defined(MODE_PERSISTENT)
+/*
+    Software global barrier for the persistent automaton. Only valid if all
+    the work groups of the launch are resident at the same time, which
+    OpenCL 1.2 doesn't guarantee: the host launches at most one work group
+    per compute unit, and a group that waits more than PERSISTENT_SPIN_LIMIT
+    polls gives up and sets the abort flag, which every other group checks
+    while waiting and after the barrier, so the launch always terminates.
+    The host then redoes the frame with one launch per step.
+    sync[0] counts the groups that reached the barrier, sync[1] is the
+    barrier generation. The last group to arrive resets the counter, clears
+    the changed flag of the next step and starts a new generation.
+ */
+#define PERSISTENT_SPIN_LIMIT (1 << 26)
+
+void global_barrier(volatile global uint* sync, uint next_changed_slot) {
+    barrier(CLK_GLOBAL_MEM_FENCE); // every work item of the group is done with the step
+
+    if (get_local_id(0) == 0) {
+        uint generation = atomic_add(&sync[1], 0);
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        if (atomic_inc(&sync[0]) == get_num_groups(0)-1) {
+            atomic_xchg(&sync[0], 0);
+            atomic_xchg(&sync[next_changed_slot], 0);
+            mem_fence(CLK_GLOBAL_MEM_FENCE);
+            atomic_inc(&sync[1]);
+        }
+        else {
+            uint spins = 0;
+            while (atomic_add(&sync[1], 0) == generation && atomic_add(&sync[5], 0) == 0) {
+                if (++spins == PERSISTENT_SPIN_LIMIT) atomic_xchg(&sync[5], 1);
+            }
+        }
+    }
+
+    barrier(CLK_GLOBAL_MEM_FENCE);
+}
+
+// one automaton_global update of pos, returns whether it changed
+uint persistent_relax(
+    read_only image2d_t luma_pic,
+    int width,
+    int height,
+    uint pos,
+    volatile global uint* t0_lattice,
+    volatile global uint* t0_labels,
+    volatile global uint* t1_lattice,
+    volatile global uint* t1_labels) {
+
+    uint x = pos % IMG_WIDTH;
+    uint y = pos / IMG_WIDTH;
+
+    uint t0_lattice_pos = t0_lattice[pos];
+
+    // x: north, y: east, z: south, w: west
+    uint4 neib_pos = (uint4){
+        y != 0 ? pos-IMG_WIDTH : pos, // exists if it's not the first row
+        x != (IMG_WIDTH-1) ? pos+1 : pos, // exists if it's not the last column
+        y != (IMG_HEIGHT-1) ? pos+IMG_WIDTH : pos, // exists if it's not the last row
+        x != 0 ? pos-1 : pos //exists if it's not the first column
+    };
+
+    uint pixel = read_imageui(luma_pic, (int2){x, y}).x;
+
+    uint2 u_t=(uint2){
+       t0_lattice_pos,
+       pos
+    };
+
+    // possible u_t candidates
+    uint4 ut_cand = (uint4){
+        add_sat(t0_lattice[neib_pos.x], pixel),
+        add_sat(t0_lattice[neib_pos.y], pixel),
+        add_sat(t0_lattice[neib_pos.z], pixel),
+        add_sat(t0_lattice[neib_pos.w], pixel),
+    };
+
+    ut_cand = select(ut_cand, (uint4)MAX_INT, ((uint4)pos == neib_pos));
+
+    u_t = u_t.x > ut_cand.x ? (uint2){ut_cand.x, neib_pos.x} : u_t;
+    u_t = u_t.x > ut_cand.y ? (uint2){ut_cand.y, neib_pos.y} : u_t;
+    u_t = u_t.x > ut_cand.z ? (uint2){ut_cand.z, neib_pos.z} : u_t;
+    u_t = u_t.x > ut_cand.w ? (uint2){ut_cand.w, neib_pos.w} : u_t;
+
+    t1_lattice[pos] = u_t.x;
+
+    uint newlabel = t0_labels[u_t.y];
+    t1_labels[pos] = newlabel;
+
+    return t0_lattice_pos != u_t.x || t0_labels[pos] != newlabel;
+}
+
+/*
+    Persistent threads automaton: launched once with one work group per
+    compute unit, the groups loop over the lattice in tiles of lws pixels and
+    keep stepping the automaton on their own until a step changes nothing.
+    The a/b buffers are used in ping pong: even steps read a and write b.
+    sync layout:
+        [0] global barrier arrival counter
+        [1] global barrier generation
+        [2] changed flag for even steps
+        [3] changed flag for odd steps
+        [4] steps executed (written by the first work item)
+        [5] abort flag, set when the global barrier timed out
+    Buffers are volatile since other groups write them between the steps.
+ */
+void kernel automaton_persistent(
+    read_only image2d_t luma_pic, // this contains the values for f(p)
+    int width,
+    int height,
+    volatile global uint* lattice_a,
+    volatile global uint* labels_a,
+    volatile global uint* lattice_b,
+    volatile global uint* labels_b,
+    volatile global uint* sync,
+    int max_steps) {
+
+    const uint img_size = IMG_WIDTH*IMG_HEIGHT;
+    const uint tile_size = get_local_size(0);
+    const uint tile_stride = tile_size*get_num_groups(0);
+    local int exit_loop;
+
+    int step = 0;
+    while (step < max_steps) {
+        volatile global uint* t0_lattice = step & 1 ? lattice_b : lattice_a;
+        volatile global uint* t0_labels = step & 1 ? labels_b : labels_a;
+        volatile global uint* t1_lattice = step & 1 ? lattice_a : lattice_b;
+        volatile global uint* t1_labels = step & 1 ? labels_a : labels_b;
+        uint changed = 0;
+
+        for (uint pos = get_group_id(0)*tile_size + get_local_id(0); pos < img_size; pos += tile_stride) {
+            changed |= persistent_relax(luma_pic, width, height, pos, t0_lattice, t0_labels, t1_lattice, t1_labels);
+        }
+
+        if (changed) atomic_or(&sync[2 + (step & 1)], 1);
+
+        global_barrier(sync, 2 + ((step+1) & 1));
+
+        // every group reads the same flags, so they all leave at the same step
+        if (get_local_id(0) == 0) exit_loop =
+            atomic_add(&sync[2 + (step & 1)], 0) == 0 || atomic_add(&sync[5], 0) != 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        step++;
+        if (exit_loop) break;
+    }
+
+    if (get_global_id(0) == 0) sync[4] = step;
+}
+
+/*
+    Fallback of the persistent automaton when its global barrier timed out:
+    a single step per launch, one work item per pixel, the host loops.
+ */
+void kernel automaton_persistent_step(
+    read_only image2d_t luma_pic, // this contains the values for f(p)
+    int width,
+    int height,
+    volatile global uint* t0_lattice,
+    volatile global uint* t0_labels,
+    volatile global uint* t1_lattice,
+    volatile global uint* t1_labels,
+    global uint* are_diff) {
 
+    uint pos = get_global_id(0);
+    if (pos >= IMG_WIDTH*IMG_HEIGHT) return; // the global work size is rounded up to the lws
 
+    if (persistent_relax(luma_pic, width, height, pos, t0_lattice, t0_labels, t1_lattice, t1_labels)) are_diff[0] = 1;
+}
+#endif
+
+
+#if defined(MODE_FRONTIER)
+/*
+    Frontier (active set) automaton: only the pixels in the worklist are
+    updated. A step is split in two launches: automaton_frontier_update
+    computes the new values of the worklist pixels into t1, reading t0 like
+    automaton_global does, then automaton_frontier_commit copies the changed
+    ones back into t0 and appends them and their neighbors to the next
+    worklist. A pixel can only change if itself or a neighbor changed in the
+    previous step, so the result is the same as the full frame automaton.
+    The t0 buffers always hold the current state.
+ */
+void kernel init_worklist(global uint* worklist) {
+    worklist[get_global_id(0)] = get_global_id(0);
+}
+
+void kernel automaton_frontier_update(
+    read_only image2d_t luma_pic, // this contains the values for f(p)
+    int width,
+    int height,
+    global const uint* t0_lattice,
+    global const uint* t0_labels,
+    global uint* t1_lattice,
+    global uint* t1_labels,
+    global const uint* worklist,
+    uint worklist_size) {
+
+    if (get_global_id(0) >= worklist_size) return; // the global work size is rounded up
+
+    const uint pos = worklist[get_global_id(0)];
+    const uint x = pos % IMG_WIDTH;
+    const uint y = pos / IMG_WIDTH;
+
+    uint t0_lattice_pos = t0_lattice[pos];
+
+    // x: north, y: east, z: south, w: west
+    uint4 neib_pos = (uint4){
+        y != 0 ? pos-IMG_WIDTH : pos, // exists if it's not the first row
+        x != (IMG_WIDTH-1) ? pos+1 : pos, // exists if it's not the last column
+        y != (IMG_HEIGHT-1) ? pos+IMG_WIDTH : pos, // exists if it's not the last row
+        x != 0 ? pos-1 : pos //exists if it's not the first column
+    };
+
+    uint pixel = read_imageui(luma_pic, (int2){x, y}).x;
+
+    uint2 u_t=(uint2){
+       t0_lattice_pos,
+       pos
+    };
+
+    // possible u_t candidates
+    uint4 ut_cand = (uint4){
+        add_sat(t0_lattice[neib_pos.x], pixel),
+        add_sat(t0_lattice[neib_pos.y], pixel),
+        add_sat(t0_lattice[neib_pos.z], pixel),
+        add_sat(t0_lattice[neib_pos.w], pixel),
+    };
+
+    ut_cand = select(ut_cand, (uint4)MAX_INT, ((uint4)pos == neib_pos));
+
+    u_t = u_t.x > ut_cand.x ? (uint2){ut_cand.x, neib_pos.x} : u_t;
+    u_t = u_t.x > ut_cand.y ? (uint2){ut_cand.y, neib_pos.y} : u_t;
+    u_t = u_t.x > ut_cand.z ? (uint2){ut_cand.z, neib_pos.z} : u_t;
+    u_t = u_t.x > ut_cand.w ? (uint2){ut_cand.w, neib_pos.w} : u_t;
+
+    t1_lattice[pos] = u_t.x;
+    t1_labels[pos] = t0_labels[u_t.y];
+}
+
+void append_to_worklist(
+    uint pos,
+    global uint* next_worklist,
+    global uint* next_worklist_size,
+    global uint* stamps,
+    uint step) {
+    // the stamp keeps a pixel from being appended twice in the same step
+    if (atomic_xchg(&stamps[pos], step) != step) {
+        next_worklist[atomic_inc(next_worklist_size)] = pos;
+    }
+}
+
+void kernel automaton_frontier_commit(
+    int width,
+    int height,
+    global uint* t0_lattice,
+    global uint* t0_labels,
+    global const uint* t1_lattice,
+    global const uint* t1_labels,
+    global const uint* worklist,
+    uint worklist_size,
+    global uint* next_worklist,
+    global uint* next_worklist_size,
+    global uint* stamps,
+    uint step) {
+
+    if (get_global_id(0) >= worklist_size) return; // the global work size is rounded up
+
+    const uint pos = worklist[get_global_id(0)];
+    const uint x = pos % IMG_WIDTH;
+    const uint y = pos / IMG_WIDTH;
+
+    uint newlattice = t1_lattice[pos];
+    uint newlabel = t1_labels[pos];
+
+    if (t0_lattice[pos] == newlattice && t0_labels[pos] == newlabel) return;
+
+    t0_lattice[pos] = newlattice;
+    t0_labels[pos] = newlabel;
+
+    append_to_worklist(pos, next_worklist, next_worklist_size, stamps, step);
+    if (y != 0) append_to_worklist(pos-IMG_WIDTH, next_worklist, next_worklist_size, stamps, step);
+    if (x != IMG_WIDTH-1) append_to_worklist(pos+1, next_worklist, next_worklist_size, stamps, step);
+    if (y != IMG_HEIGHT-1) append_to_worklist(pos+IMG_WIDTH, next_worklist, next_worklist_size, stamps, step);
+    if (x != 0) append_to_worklist(pos-1, next_worklist, next_worklist_size, stamps, step);
+}
+#endif
+
+
+#if defined(MODE_IMAGE)
 void kernel automaton_image(
     read_only image2d_t luma_pic, // this contains the values for f(p)
     int width,
@@ -297,9 +1096,9 @@ void kernel automaton_image(
 
     const uint x = get_global_id(0);
     const uint y = get_global_id(1);
-    const uint img_size = width*height;
+    const uint img_size = IMG_WIDTH*IMG_HEIGHT;
 
-    const int iamoutofbound = get_global_id(0) >= width || get_global_id(1) >= height;
+    const int iamoutofbound = get_global_id(0) >= IMG_WIDTH || get_global_id(1) >= IMG_HEIGHT;
     if (iamoutofbound) return; // failsafe (the global work sizes can be bigger than the image sizes)
 
     //const int iamoutofbound = x >= width || y >= height;
@@ -310,8 +1109,8 @@ void kernel automaton_image(
     // 0: north, 1: east, 2: south, 3: west, 4: pos
     int2 neib_pos[5] = {
         y != 0 ? (int2){x, y-1} : pos, // exists if it's not the first row
-        x != width-1 ? (int2){x+1, y} : pos, // exists if it's not the last column
-        y != height-1 ? (int2){x, y+1} : pos, // exists if it's not the last row
+        x != IMG_WIDTH-1 ? (int2){x+1, y} : pos, // exists if it's not the last column
+        y != IMG_HEIGHT-1 ? (int2){x, y+1} : pos, // exists if it's not the last row
         x != 0 ? (int2){x-1, y} : pos, //exists if it's not the first column
         pos
     };
@@ -360,6 +1159,437 @@ void kernel automaton_image(
         label_at_pos != newlabel // equivalent to t1_labels[pos]
     ) are_diff[0] = 1;
 }
+#endif
+
+#if defined(MODE_GLOBAL)
+/*
+    Red-black (checkerboard) Gauss-Seidel schedules. A sweep is two half
+    steps: the first updates the pixels with (x+y) even, the second the odd
+    ones. With 4-connectivity every neighbor of a pixel has the other color,
+    so each half step reads what the previous one just wrote without any
+    race and the result is reproducible.
+    The global memory version works in place and only launches the pixels
+    of the current color (get_global_id(0) indexes every other column).
+ */
+void kernel automaton_global_redblack(
+    read_only image2d_t luma_pic, // this contains the values for f(p)
+    int width,
+    int height,
+    global uint* lattice,
+    global uint* labels,
+    global uint* are_diff,
+    int color) {
+
+    const uint y = get_global_id(1);
+    const uint x = 2*get_global_id(0) + ((y + color) & 1);
+
+    const int iamoutofbound = x >= IMG_WIDTH || y >= IMG_HEIGHT;
+    if (iamoutofbound) return; // failsafe (the global work sizes can be bigger than the image sizes)
+
+    uint pos = x+(y*IMG_WIDTH);
+
+    uint lattice_pos = lattice[pos];
+
+    // x: north, y: east, z: south, w: west
+    uint4 neib_pos = (uint4){
+        y != 0 ? pos-IMG_WIDTH : pos, // exists if it's not the first row
+        x != (IMG_WIDTH-1) ? pos+1 : pos, // exists if it's not the last column
+        y != (IMG_HEIGHT-1) ? pos+IMG_WIDTH : pos, // exists if it's not the last row
+        x != 0 ? pos-1 : pos, //exists if it's not the first column
+    };
+
+    uint pixel = read_imageui(luma_pic, (int2){x, y}).x;
+
+    uint2 u_t=(uint2){
+       lattice_pos,
+       pos
+    };
+
+    // possible u_t candidates
+    uint4 ut_cand = (uint4){
+        add_sat(lattice[neib_pos.x], pixel),
+        add_sat(lattice[neib_pos.y], pixel),
+        add_sat(lattice[neib_pos.z], pixel),
+        add_sat(lattice[neib_pos.w], pixel),
+    };
+
+    ut_cand = select(ut_cand, (uint4)MAX_INT, ((uint4)pos == neib_pos));
+
+    u_t = u_t.x > ut_cand.x ? (uint2){ut_cand.x, neib_pos.x} : u_t;
+    u_t = u_t.x > ut_cand.y ? (uint2){ut_cand.y, neib_pos.y} : u_t;
+    u_t = u_t.x > ut_cand.z ? (uint2){ut_cand.z, neib_pos.z} : u_t;
+    u_t = u_t.x > ut_cand.w ? (uint2){ut_cand.w, neib_pos.w} : u_t;
+
+    // the lattice only changes if a neighbor (of the other color) wins
+    if (u_t.y == pos) return;
+
+    uint newlabel = labels[u_t.y];
+    uint oldlabel = labels[pos];
+    lattice[pos] = u_t.x;
+    labels[pos] = newlabel;
+
+    if (
+        lattice_pos != u_t.x ||
+        oldlabel != newlabel
+    ) are_diff[0] = 1;
+}
+#endif
+
+#if defined(MODE_IMAGE)
+/*
+    Images can't be read and written by the same kernel, so the texture
+    version still ping pongs: the pixels of the other color are copied over.
+ */
+void kernel automaton_image_redblack(
+    read_only image2d_t luma_pic, // this contains the values for f(p)
+    int width,
+    int height,
+    read_only image2d_t t0_lattice,
+    read_only image2d_t t0_labels,
+    write_only image2d_t t1_lattice,
+    write_only image2d_t t1_labels,
+    global uint* are_diff,
+    int color) {
+
+    const uint x = get_global_id(0);
+    const uint y = get_global_id(1);
+
+    const int iamoutofbound = get_global_id(0) >= IMG_WIDTH || get_global_id(1) >= IMG_HEIGHT;
+    if (iamoutofbound) return; // failsafe (the global work sizes can be bigger than the image sizes)
+
+    int2 pos = (int2){x, y};
+
+    uint lattice_at_pos = read_imageui(t0_lattice, sampler, pos).x;
+    uint label_at_pos = read_imageui(t0_labels, sampler, pos).x;
+
+    if (((x + y) & 1) != color) {
+        write_imageui(t1_lattice, pos, lattice_at_pos);
+        write_imageui(t1_labels, pos, label_at_pos);
+        return;
+    }
+
+    // 0: north, 1: east, 2: south, 3: west, 4: pos
+    int2 neib_pos[5] = {
+        y != 0 ? (int2){x, y-1} : pos, // exists if it's not the first row
+        x != IMG_WIDTH-1 ? (int2){x+1, y} : pos, // exists if it's not the last column
+        y != IMG_HEIGHT-1 ? (int2){x, y+1} : pos, // exists if it's not the last row
+        x != 0 ? (int2){x-1, y} : pos, //exists if it's not the first column
+        pos
+    };
+
+    uint pixel = read_imageui(luma_pic, sampler, pos).x;
+
+    uint4 neib_lattice_vals = (uint4){
+        read_imageui(t0_lattice, sampler, neib_pos[0]).x,
+        read_imageui(t0_lattice, sampler, neib_pos[1]).x,
+        read_imageui(t0_lattice, sampler, neib_pos[2]).x,
+        read_imageui(t0_lattice, sampler, neib_pos[3]).x
+    };
+
+    uint2 u_t=(uint2){
+       lattice_at_pos,
+       4
+    };
+
+    // possible u_t candidates
+    uint4 ut_cand = add_sat(neib_lattice_vals, (uint4)pixel);
+
+    ut_cand = (uint4){
+        (pos.x == neib_pos[0].x && pos.y == neib_pos[0].y) ? MAX_INT : ut_cand.x,
+        (pos.x == neib_pos[1].x && pos.y == neib_pos[1].y) ? MAX_INT : ut_cand.y,
+        (pos.x == neib_pos[2].x && pos.y == neib_pos[2].y) ? MAX_INT : ut_cand.z,
+        (pos.x == neib_pos[3].x && pos.y == neib_pos[3].y) ? MAX_INT : ut_cand.w
+    };
+
+    u_t = u_t.x > ut_cand.x ? (uint2){ut_cand.x, 0} : u_t;
+    u_t = u_t.x > ut_cand.y ? (uint2){ut_cand.y, 1} : u_t;
+    u_t = u_t.x > ut_cand.z ? (uint2){ut_cand.z, 2} : u_t;
+    u_t = u_t.x > ut_cand.w ? (uint2){ut_cand.w, 3} : u_t;
+
+    write_imageui(t1_lattice, pos, u_t.x);
+    uint newlabel = read_imageui(t0_labels, sampler, neib_pos[u_t.y]).x;
+    write_imageui(t1_labels, pos, newlabel);
+
+    if (
+        lattice_at_pos != u_t.x ||
+        label_at_pos != newlabel
+    ) are_diff[0] = 1;
+}
+#endif
+
+
+#if defined(MODE_ARROWS)
+void kernel steepest_descent(
+    read_only image2d_t heights,
+    int width,
+    int height,
+    global uint* parent) {
+
+    const int2 pos = (int2){get_global_id(0), get_global_id(1)};
+    const uint linearpos = pos.x + pos.y*IMG_WIDTH;
+
+    // x: north, y: east, z: south, w: west
+    uint4 neib_pos = (uint4){
+        pos.y != 0 ? linearpos-IMG_WIDTH : linearpos, // exists if it's not the first row
+        pos.x != (IMG_WIDTH-1) ? linearpos+1 : linearpos, // exists if it's not the last column
+        pos.y != (IMG_HEIGHT-1) ? linearpos+IMG_WIDTH : linearpos, // exists if it's not the last row
+        pos.x != 0 ? linearpos-1 : linearpos //exists if it's not the first column
+    };
+
+    uint4 neib_heights = (uint4){
+        read_imageui(heights, sampler, pos + (int2){0, -1}).x,
+        read_imageui(heights, sampler, pos + (int2){1, 0}).x,
+        read_imageui(heights, sampler, pos + (int2){0, 1}).x,
+        read_imageui(heights, sampler, pos + (int2){-1, 0}).x
+    };
+    // clamped reads on the borders return the pixel itself, which is never strictly lower
+
+    uint2 lowest = (uint2){read_imageui(heights, pos).x, linearpos};
+    lowest = lowest.x > neib_heights.x ? (uint2){neib_heights.x, neib_pos.x} : lowest;
+    lowest = lowest.x > neib_heights.y ? (uint2){neib_heights.y, neib_pos.y} : lowest;
+    lowest = lowest.x > neib_heights.z ? (uint2){neib_heights.z, neib_pos.z} : lowest;
+    lowest = lowest.x > neib_heights.w ? (uint2){neib_heights.w, neib_pos.w} : lowest;
+
+    parent[linearpos] = lowest.y;
+}
+#endif
+
+#if defined(MODE_UNIONFIND)
+/*
+    Union-find watershed over the automaton's seeds (init_t0, gradient == 0).
+    The heights are lower bounds of the automaton's cost, packed with the
+    number of hops as cost << 32 | hops so that a single min orders them:
+    a seed is 0, any other pixel starts at (its luma, 1 hop), and a bounded
+    number of Jacobi steps (uf_lookahead) raises them towards the cost and
+    hops of the cheapest path from a seed.
+    Every pixel then links to its lowest neighbor, the first one in north,
+    east, south, west order among equals, if it is strictly lower; seeds are
+    always roots. Flat pixels of equal height are merged with a union-find
+    (atomic_min hooking of the higher root under the lower one, path
+    compression in find), a plateau with a way down drains through its
+    lowest index exit, and pointer jumping resolves every pixel to its root.
+    The pass count is the lookahead plus a few hooking and a logarithmic
+    number of compression passes, independent of the basin diameter.
+    Once the lookahead has converged the heights are the automaton's costs,
+    nothing is flat but the seeds and every link is the neighbor the Jacobi
+    automaton takes its final label from: the labels are the automaton's,
+    ties included. Stopped earlier, the descent follows the lower bounds,
+    so a pixel whose cheapest path is longer than the lookahead can end up
+    in another seed's basin, and a flat region with no way down becomes a
+    basin of its own, labelled with its lowest index pixel.
+    Pixels whose height saturates, which no seed reaches at a cost the
+    automaton can represent, keep init_t0's label 0 as in the automaton.
+ */
+#define UF_UNREACHED ((ulong)MAX_INT << 32 | MAX_INT)
+
+void kernel uf_init_heights(
+    read_only image2d_t luma_pic,
+    int width,
+    read_only image2d_t gradient_pic,
+    global ulong* heights) {
+
+    uint pixval = read_imageui(gradient_pic, (int2){get_global_id(0), get_global_id(1)}).x;
+    uint pixel = read_imageui(luma_pic, (int2){get_global_id(0), get_global_id(1)}).x;
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    // no path into a pixel is cheaper than its own luma in a single hop
+    heights[pos] = pixval == 0 ? (ulong)0 : (ulong)pixel << 32 | 1;
+}
+
+// (cost, hops) of the path through a neighbor, saturating like the automaton
+ulong uf_candidate(ulong neib, uint pixel) {
+    uint cost = add_sat((uint)(neib >> 32), pixel);
+    if (cost == MAX_INT) return UF_UNREACHED;
+    return (ulong)cost << 32 | ((uint)neib + 1);
+}
+
+uint4 uf_neighbors(uint pos) {
+    // x: north, y: east, z: south, w: west; the pixel itself where there is no neighbor
+    uint x = pos % IMG_WIDTH;
+    uint y = pos / IMG_WIDTH;
+    return (uint4){
+        y != 0 ? pos-IMG_WIDTH : pos,
+        x != (IMG_WIDTH-1) ? pos+1 : pos,
+        y != (IMG_HEIGHT-1) ? pos+IMG_WIDTH : pos,
+        x != 0 ? pos-1 : pos
+    };
+}
+
+/*
+    Jacobi step over the packed heights, t0 -> t1. The neighbors only hold
+    lower bounds, so the cheapest candidate is one too, and never below the
+    previous one: the heights only grow, up to the automaton's costs.
+ */
+void kernel uf_lookahead(
+    read_only image2d_t luma_pic,
+    int width,
+    int height,
+    global const ulong* t0_heights,
+    global ulong* t1_heights,
+    global uint* are_diff) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    uint4 neib_pos = uf_neighbors(pos);
+    uint pixel = read_imageui(luma_pic, (int2){get_global_id(0), get_global_id(1)}).x;
+
+    ulong own = t0_heights[pos];
+    ulong best = own;
+    if (own != 0) { // seeds stay at 0
+        best = UF_UNREACHED;
+        if (neib_pos.x != pos) best = min(best, uf_candidate(t0_heights[neib_pos.x], pixel));
+        if (neib_pos.y != pos) best = min(best, uf_candidate(t0_heights[neib_pos.y], pixel));
+        if (neib_pos.z != pos) best = min(best, uf_candidate(t0_heights[neib_pos.z], pixel));
+        if (neib_pos.w != pos) best = min(best, uf_candidate(t0_heights[neib_pos.w], pixel));
+    }
+
+    t1_heights[pos] = best;
+    if (best != own) are_diff[0] = 1;
+}
+
+int uf_is_flat(global const ulong* heights, uint4 neib_pos, ulong h) {
+    // border pixels compare with themselves, which is never strictly lower
+    return !(heights[neib_pos.x] < h || heights[neib_pos.y] < h ||
+             heights[neib_pos.z] < h || heights[neib_pos.w] < h);
+}
+
+uint uf_find(global uint* parent, uint p) {
+    uint root = p;
+    while (parent[root] != root) root = parent[root];
+    // path compression: any ancestor is a valid parent, atomic_min never undoes another hook
+    if (root != p) atomic_min(&parent[p], root);
+    return root;
+}
+
+void kernel uf_descent(
+    int width,
+    int height,
+    global const ulong* heights,
+    global uint* parent) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    uint4 neib_pos = uf_neighbors(pos);
+
+    ulong lowest = heights[pos];
+    uint link = pos; // seeds and flat pixels are roots for now
+    if (heights[neib_pos.x] < lowest) { lowest = heights[neib_pos.x]; link = neib_pos.x; }
+    if (heights[neib_pos.y] < lowest) { lowest = heights[neib_pos.y]; link = neib_pos.y; }
+    if (heights[neib_pos.z] < lowest) { lowest = heights[neib_pos.z]; link = neib_pos.z; }
+    if (heights[neib_pos.w] < lowest) { lowest = heights[neib_pos.w]; link = neib_pos.w; }
+    parent[pos] = link;
+}
+
+void kernel uf_hook_plateaus(
+    int width,
+    int height,
+    global const ulong* heights,
+    global uint* parent,
+    global uint* changed) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    uint4 neib_pos = uf_neighbors(pos);
+    ulong h = heights[pos];
+
+    // seeds are basins of their own, like in the automaton
+    if (h == 0 || !uf_is_flat(heights, neib_pos, h)) return;
+
+    // only east and south: every pair of neighbors is visited once
+    uint neib[2] = {neib_pos.y, neib_pos.z};
+    for (int i=0; i<2; i++) {
+        if (neib[i] == pos || heights[neib[i]] != h) continue;
+        if (!uf_is_flat(heights, uf_neighbors(neib[i]), h)) continue;
+
+        uint root_p = uf_find(parent, pos);
+        uint root_q = uf_find(parent, neib[i]);
+        if (root_p == root_q) continue;
+
+        // hook the higher root under the lower one: parents only decrease, so no cycles.
+        // If another item hooked it first the next pass retries with the new roots
+        atomic_min(&parent[max(root_p, root_q)], min(root_p, root_q));
+        changed[0] = 1;
+    }
+}
+
+void kernel uf_find_exits(
+    int width,
+    int height,
+    global const ulong* heights,
+    global uint* parent,
+    global uint* exits) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    uint4 neib_pos = uf_neighbors(pos);
+    ulong h = heights[pos];
+
+    if (h == 0 || !uf_is_flat(heights, neib_pos, h)) return;
+
+    uint neib[4] = {neib_pos.x, neib_pos.y, neib_pos.z, neib_pos.w};
+    uint root = uf_find(parent, pos);
+    for (int i=0; i<4; i++) {
+        if (neib[i] == pos || heights[neib[i]] != h) continue;
+        // an equal neighbor that isn't flat has a way down: the whole plateau drains through it
+        if (uf_is_flat(heights, uf_neighbors(neib[i]), h)) continue;
+        atomic_min(&exits[root], neib[i]);
+    }
+}
+
+void kernel uf_link_exits(
+    int width,
+    global uint* parent,
+    global const uint* exits) {
+
+    const uint pos = get_global_id(0) + get_global_id(1)*IMG_WIDTH;
+    // the exit has a strictly lower neighbor and descending never leads back to the plateau, so no cycles
+    if (parent[pos] == pos && exits[pos] != MAX_INT) parent[pos] = exits[pos];
+}
+
+void kernel uf_compress(
+    int width,
+    global uint* parent,
+    global uint* changed) {
+
+    const uint linearpos = get_global_id(0) + get_global_id(1)*IMG_WIDTH;
+    uint p = parent[linearpos];
+    uint pp = parent[p];
+    // in place pointer jumping: every write is still an ancestor, so races only slow it down
+    if (p != pp) {
+        parent[linearpos] = pp;
+        changed[0] = 1;
+    }
+}
+
+// pixels no seed can reach keep init_t0's label
+void kernel uf_unreached_labels(
+    int width,
+    global const ulong* heights,
+    global uint* labels) {
+
+    uint pos = get_global_id(0)+(get_global_id(1)*IMG_WIDTH);
+    if (heights[pos] == UF_UNREACHED) labels[pos] = 0;
+}
+#endif
+
+
+#if defined(MODE_ARROWS)
+/*
+    Pointer jumping over the steepest descent arrows (see steepest_descent):
+    each step makes every pixel point to its parent's parent, so chains of
+    length n are resolved in log2(n) steps. Flat pixels are their own roots,
+    so plateaus aren't merged (use the union-find engine for that).
+ */
+void kernel pointer_jump(
+    int width,
+    global const uint* t0_labels,
+    global uint* t1_labels,
+    global uint* are_diff) {
+
+    const uint pos = get_global_id(0) + get_global_id(1)*IMG_WIDTH;
+    uint parent = t0_labels[pos];
+    uint grandparent = t0_labels[parent];
+
+    t1_labels[pos] = grandparent;
+
+    if (parent != grandparent) are_diff[0] = 1;
+}
+#endif
 
 
 void kernel color_watershed(
@@ -369,15 +1599,15 @@ void kernel color_watershed(
     global const uint* labels,
     write_only image2d_t outimage) {
 
-    int pos = get_global_id(0) + (get_global_id(1) * width);
+    int pos = get_global_id(0) + (get_global_id(1) * IMG_WIDTH);
     int index = labels[pos];
 
     uint4 pixel = read_imageui(
         original,
         sampler,
         (int2){
-            index % width,
-            index / width
+            index % IMG_WIDTH,
+            index / IMG_WIDTH
         }
     );
     write_imageui(
@@ -401,8 +1631,8 @@ void kernel color_watershed_image(
         original,
         sampler,
         (int2){
-            index % width,
-            index / width
+            index % IMG_WIDTH,
+            index / IMG_WIDTH
         }
     );
     write_imageui(
@@ -1,5 +1,5 @@
 TEMPLATE = app
-CONFIG += console c++11
+CONFIG += console c++11 thread
 CONFIG -= app_bundle
 CONFIG -= qt
 
@@ -12,15 +12,25 @@ DISTFILES += \
     ocl_source.cl \
     include/cxxopts_LICENSE
 
-copyfiles.commands = cp $$PWD/*.cl $$OUT_PWD/
-
-QMAKE_EXTRA_TARGETS += copyfiles
-POST_TARGETDEPS += copyfiles
+# the kernels are embedded in the executable as a raw string literal
+CL_SOURCES = ocl_source.cl
+embed_cl.input = CL_SOURCES
+embed_cl.output = ${QMAKE_FILE_IN_BASE}.inc
+embed_cl.commands = ( echo \'R\"OCLSRC(\' && cat ${QMAKE_FILE_IN} && echo \')OCLSRC\"\' ) > ${QMAKE_FILE_OUT}
+embed_cl.CONFIG += no_link target_predeps
+QMAKE_EXTRA_COMPILERS += embed_cl
+INCLUDEPATH += $$OUT_PWD
 
 HEADERS += \
     cl_errorcheck.hpp \
     imagelib.hpp \
     io_helper.hpp \
     ocl_helper.hpp \
+    program_cache.hpp \
+    frame_queue.hpp \
+    strips.hpp \
+    tiles.hpp \
+    cpu_backend.hpp \
+    flood.hpp \
     graph.hpp \
     include/cxxopts.hpp
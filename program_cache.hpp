@@ -0,0 +1,282 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <string>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
+/*
+    Built programs, kept in memory keyed by their build options so that runs
+    over images of the same size in the same process don't rebuild, and on
+    disk as CL_PROGRAM_BINARIES so that short lived runs don't pay for the
+    JIT compilation at all.
+    A disk entry lives in a slot named after the hash of the build options
+    and the device name. Its header records the hash of the source and the
+    driver version it was built from: if either changed the entry is stale,
+    so it gets rebuilt and overwritten.
+ */
+typedef struct tagPROGRAM_CACHE {
+    std::map<std::string, cl::Program> programs;
+    std::map<std::string, cl::Kernel> kernels; // keyed by build options + kernel name
+    std::string disk_dir; // empty to disable the disk cache
+    int memory_hits;
+    int disk_hits;
+    int misses;
+    int stale;
+} PROGRAM_CACHE;
+
+#define PROGRAM_CACHE_MAGIC "ocl_watershed program cache 1"
+
+void init_program_cache(PROGRAM_CACHE &cache, std::string disk_dir) {
+    cache.programs.clear();
+    cache.kernels.clear();
+    cache.disk_dir = disk_dir;
+    cache.memory_hits = 0;
+    cache.disk_hits = 0;
+    cache.misses = 0;
+    cache.stale = 0;
+}
+
+std::string default_program_cache_dir() {
+    const char* xdg_cache = getenv("XDG_CACHE_HOME");
+    if (xdg_cache && xdg_cache[0]) return std::string(xdg_cache) + "/ocl_watershed";
+    const char* home = getenv("HOME");
+    if (home && home[0]) return std::string(home) + "/.cache/ocl_watershed";
+    return "";
+}
+
+std::string fnv1a_hash(const std::string &data) {
+    // 64 bit FNV-1a, plenty to tell sources and options apart
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i=0; i<data.length(); i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ull;
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return std::string(hex);
+}
+
+bool make_dirs(const std::string &path) {
+    // mkdir -p
+    for (size_t i=1; i<=path.length(); i++) {
+        if (i == path.length() || path[i] == '/') {
+            std::string partial = path.substr(0, i);
+            if (mkdir(partial.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        }
+    }
+    return true;
+}
+
+std::string mode_options(const std::string &automaton_memory) {
+    // selects the kernel subset of an automaton, see the top of ocl_source.cl
+    std::string mode = automaton_memory;
+    for (size_t i=0; i<mode.length(); i++) mode[i] = toupper(mode[i]);
+    return "-DMODE_" + mode;
+}
+
+std::string specialization_options(int width, int height, int lws=0, int connectivity=4) {
+    // see the top of ocl_source.cl for the macros
+    std::string options =
+        "-DWIDTH=" + std::to_string(width) +
+        " -DHEIGHT=" + std::to_string(height) +
+        " -DCONNECTIVITY=" + std::to_string(connectivity);
+    if (lws) options += " -DLWS_X=" + std::to_string(lws);
+    return options;
+}
+
+bool load_program_binary(
+        PROGRAM_CACHE &cache,
+        cl::Context &context,
+        cl::Device &device,
+        const std::string &entry_path,
+        const std::string &source_hash,
+        const std::string &driver_version,
+        const std::string &options,
+        cl::Program &program) {
+
+    std::ifstream entry(entry_path, std::ios::binary);
+    if (!entry) return false;
+
+    std::string magic, entry_source_hash, entry_driver_version, size_line;
+    std::getline(entry, magic);
+    std::getline(entry, entry_source_hash);
+    std::getline(entry, entry_driver_version);
+    std::getline(entry, size_line);
+
+    if (magic != PROGRAM_CACHE_MAGIC ||
+        entry_source_hash != source_hash ||
+        entry_driver_version != driver_version) {
+        cache.stale++;
+        return false;
+    }
+
+    // a corrupt or empty size line makes the entry stale, not fatal
+    char *size_end = NULL;
+    errno = 0;
+    unsigned long long parsed_size = strtoull(size_line.c_str(), &size_end, 10);
+    if (size_line.empty() || size_line[0] < '0' || size_line[0] > '9' ||
+        *size_end != '\0' || errno == ERANGE || parsed_size == 0) {
+        cache.stale++;
+        return false;
+    }
+    // nor should a size larger than the file allocate anything
+    std::streampos binary_start = entry.tellg();
+    if (binary_start == std::streampos(-1)) {
+        cache.stale++;
+        return false;
+    }
+    entry.seekg(0, std::ios::end);
+    unsigned long long available = (unsigned long long)(entry.tellg() - binary_start);
+    entry.seekg(binary_start);
+    if (parsed_size > available) {
+        cache.stale++;
+        return false;
+    }
+
+    size_t binary_size = (size_t)parsed_size;
+    std::vector<char> binary(binary_size);
+    entry.read(&binary[0], binary_size);
+    if ((size_t)entry.gcount() != binary_size) {
+        cache.stale++;
+        return false;
+    }
+
+    cl_int err;
+    std::vector<cl_int> binary_status;
+    cl::Program::Binaries binaries;
+    binaries.push_back({&binary[0], binary_size});
+    program = cl::Program(context, {device}, binaries, &binary_status, &err);
+    if (err != CL_SUCCESS || program.build({device}, options.c_str()) != CL_SUCCESS) {
+        // the driver refused it (e.g. a different compiler build): treat it as stale
+        cache.stale++;
+        return false;
+    }
+    return true;
+}
+
+void store_program_binary(
+        PROGRAM_CACHE &cache,
+        cl::Program &program,
+        const std::string &entry_path,
+        const std::string &source_hash,
+        const std::string &driver_version) {
+
+    if (!make_dirs(cache.disk_dir)) {
+        std::cerr << TERM_RED << "Error: could not create program cache directory " <<
+            cache.disk_dir << TERM_RESET << std::endl;
+        return;
+    }
+
+    // single device programs: one binary
+    size_t binary_size = 0;
+    cl_int err = clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL);
+    if (err != CL_SUCCESS || binary_size == 0) return;
+
+    std::vector<unsigned char> binary(binary_size);
+    unsigned char* binary_ptr = &binary[0];
+    err = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary_ptr, NULL);
+    if (err != CL_SUCCESS) return;
+
+    // write to a temporary file first, so a concurrent run never reads half an entry
+    std::string tmp_path = entry_path + ".tmp" + std::to_string(getpid());
+    std::ofstream entry(tmp_path, std::ios::binary);
+    if (!entry) return;
+    entry << PROGRAM_CACHE_MAGIC << "\n" <<
+        source_hash << "\n" <<
+        driver_version << "\n" <<
+        binary_size << "\n";
+    entry.write((const char*)&binary[0], binary_size);
+    entry.close();
+    rename(tmp_path.c_str(), entry_path.c_str());
+}
+
+cl::Program get_program(
+        PROGRAM_CACHE &cache,
+        cl::Context &context,
+        cl::Device &device,
+        const std::string &source,
+        const std::string &options) {
+
+    std::map<std::string, cl::Program>::iterator cached = cache.programs.find(options);
+    if (cached != cache.programs.end()) {
+        cache.memory_hits++;
+        return cached->second;
+    }
+
+    cl::Program program;
+    std::string entry_path;
+    std::string source_hash;
+    std::string driver_version;
+
+    if (!cache.disk_dir.empty()) {
+        source_hash = fnv1a_hash(source);
+        driver_version = device.getInfo<CL_DRIVER_VERSION>();
+        std::string slot = fnv1a_hash(options + '\n' + device.getInfo<CL_DEVICE_NAME>());
+        entry_path = cache.disk_dir + "/" + slot + ".bin";
+
+        if (load_program_binary(cache, context, device, entry_path, source_hash, driver_version, options, program)) {
+            cache.disk_hits++;
+            cache.programs[options] = program;
+            return program;
+        }
+    }
+
+    cache.misses++;
+
+    cl::Program::Sources sources;
+    sources.push_back({source.c_str(), source.length()});
+    program = cl::Program(context, sources);
+    if (program.build({device}, options.c_str()) != CL_SUCCESS) {
+        std::cerr << TERM_RED <<
+                     "Error Building: " <<
+                     program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) <<
+                     TERM_RESET << std::endl;
+        exit(1);
+    }
+
+#if DEBUG
+    std::cout << "Built program" <<
+        (options.empty() ? "" : " with options: " + options) << std::endl;
+#endif
+
+    // overwrites stale entries in the same slot
+    if (!entry_path.empty()) store_program_binary(cache, program, entry_path, source_hash, driver_version);
+
+    cache.programs[options] = program;
+    return program;
+}
+
+cl::Kernel get_kernel(
+        PROGRAM_CACHE &cache,
+        cl::Program &program,
+        const std::string &options,
+        const std::string &name) {
+
+    // kernels of an already built program are reused too, their arguments get set on every use
+    std::string key = options + '\n' + name;
+    std::map<std::string, cl::Kernel>::iterator cached = cache.kernels.find(key);
+    if (cached != cache.kernels.end()) return cached->second;
+
+    cl_int err;
+    cl::Kernel kernel(program, name.c_str(), &err);
+    cl_check(err, "Creating kernel " + name);
+    cache.kernels[key] = kernel;
+    return kernel;
+}
+
+void print_program_cache_stats(PROGRAM_CACHE &cache) {
+    std::cout << TERM_CYAN <<
+        "Program cache: " <<
+        cache.memory_hits << " memory hits, " <<
+        cache.disk_hits << " disk hits, " <<
+        cache.misses << " misses (" <<
+        cache.stale << " stale entries rebuilt)" <<
+        TERM_RESET << std::endl;
+}
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+/*
+    Multi-device domain decomposition: the image is split in horizontal
+    strips, one per device (possibly of different platforms), each device
+    runs the global automaton on the rows it owns and the boundary rows are
+    exchanged through the host every exchange interval steps.
+    Every device keeps full size buffers, so positions (and thus labels)
+    are the same everywhere and a strip is just an NDRange offset; besides
+    its own rows a device only ever needs the row above and below them.
+    Reading a neighbor row that is a few steps old is still a valid
+    (chaotic) relaxation, values only decrease, so the exchange interval
+    trades convergence speed for fewer synchronizations.
+ */
+typedef struct tagSTRIP_DEVICE {
+    cl::Device device;
+    cl::Context context;
+    cl::CommandQueue queue;
+    PROGRAM_CACHE program_cache;
+    std::string build_options;
+    cl::Kernel kernel_make_luma_image;
+    cl::Kernel kernel_make_gradient;
+    cl::Kernel kernel_init_t0;
+    cl::Kernel kernel_automaton_global;
+    int width; // allocated size
+    int height;
+    cl::Image2D input_image;
+    cl::Image2D luma_image;
+    cl::Image2D gradient_image;
+    cl::Buffer lattice[2];
+    cl::Buffer labels[2];
+    cl::Buffer are_diff;
+    int current; // which of the two buffers holds the latest state
+    int row_begin; // owned rows
+    int row_end;
+    double throughput; // measured pixel updates per second, 0 until calibrated
+} STRIP_DEVICE;
+
+void init_strip_devices(std::vector<STRIP_DEVICE> &strips, const std::vector<cl::Device> &devices, const std::string &cache_dir) {
+    strips.resize(devices.size());
+    for (size_t i=0; i<devices.size(); i++) {
+        // separate contexts, the devices may belong to different platforms
+        strips[i].device = devices[i];
+        strips[i].context = cl::Context({devices[i]});
+        strips[i].queue = cl::CommandQueue(strips[i].context, devices[i]);
+        init_program_cache(strips[i].program_cache, cache_dir);
+        strips[i].width = 0;
+        strips[i].height = 0;
+        strips[i].throughput = 0;
+    }
+}
+
+void acquire_strip_device(STRIP_DEVICE &strip, const std::string &source, int width, int height, bool jit_specialize) {
+    if (strip.width == width && strip.height == height) return;
+
+    cl_int err;
+    std::string build_options = mode_options("global");
+    if (jit_specialize) build_options += " " + specialization_options(width, height);
+    cl::Program program = get_program(strip.program_cache, strip.context, strip.device, source, build_options);
+    strip.kernel_make_luma_image = get_kernel(strip.program_cache, program, build_options, "make_luma_image");
+    strip.kernel_make_gradient = get_kernel(strip.program_cache, program, build_options, "make_gradient");
+    strip.kernel_init_t0 = get_kernel(strip.program_cache, program, build_options, "init_t0");
+    strip.kernel_automaton_global = get_kernel(strip.program_cache, program, build_options, "automaton_global");
+
+    strip.input_image = cl::Image2D(
+                strip.context,
+                CL_MEM_READ_ONLY,
+                cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
+                width, height,
+                0,
+                NULL,
+                &err);
+    cl_check(err, "Creating strip input image");
+
+    strip.luma_image = cl::Image2D(
+                strip.context,
+                CL_MEM_READ_WRITE,
+                cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
+                width, height,
+                0,
+                NULL,
+                &err);
+    cl_check(err, "Creating strip luma image");
+
+    strip.gradient_image = cl::Image2D(
+                strip.context,
+                CL_MEM_READ_WRITE,
+                cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
+                width, height,
+                0,
+                NULL,
+                &err);
+    cl_check(err, "Creating strip gradient image");
+
+    for (int i=0; i<2; i++) {
+        strip.lattice[i] = cl::Buffer(strip.context, CL_MEM_READ_WRITE, sizeof(cl_uint)*width*height);
+        strip.labels[i] = cl::Buffer(strip.context, CL_MEM_READ_WRITE, sizeof(cl_uint)*width*height);
+    }
+    strip.are_diff = cl::Buffer(strip.context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+
+    strip.width = width;
+    strip.height = height;
+}
+
+size_t active_strips(const std::vector<STRIP_DEVICE> &strips, int height) {
+    // a strip owns at least a row, so an image shorter than the device list leaves the rest idle
+    return std::min(strips.size(), (size_t)height);
+}
+
+void balance_strips(std::vector<STRIP_DEVICE> &strips, int height) {
+    // rows proportional to the measured throughput, even split until it's known
+    size_t active = active_strips(strips, height);
+    double total = 0;
+    bool calibrated = true;
+    for (size_t i=0; i<active; i++) {
+        total += strips[i].throughput;
+        calibrated = calibrated && strips[i].throughput > 0;
+    }
+
+    int row = 0;
+    for (size_t i=0; i<active; i++) {
+        int remaining_strips = active-i-1;
+        int rows = calibrated ?
+            (int)(height*strips[i].throughput/total + 0.5) :
+            height/(int)active;
+        // every device gets at least a row, the last one gets the rest
+        rows = std::max(1, std::min(rows, height-row-remaining_strips));
+        if (i == active-1) rows = height-row;
+        strips[i].row_begin = row;
+        strips[i].row_end = row+rows;
+        row += rows;
+    }
+    for (size_t i=active; i<strips.size(); i++) {
+        strips[i].row_begin = height;
+        strips[i].row_end = height;
+    }
+}
+
+void enqueue_strip_rows(STRIP_DEVICE &strip, cl::Kernel &kernel, int row_begin, int row_end, const std::string &message) {
+    row_begin = std::max(row_begin, 0);
+    row_end = std::min(row_end, strip.height);
+    cl_int err = strip.queue.enqueueNDRangeKernel(
+                kernel,
+                cl::NDRange(0, row_begin),
+                cl::NDRange(strip.width, row_end-row_begin),
+                cl::NullRange);
+    cl_check(err, message);
+}
+
+void enqueue_strip_steps(STRIP_DEVICE &strip, int steps) {
+    // the automaton only writes the owned rows, the halo rows of both
+    // buffers are left to the exchange
+    cl_int err = strip.queue.enqueueFillBuffer(strip.are_diff, (cl_uint)0, 0, sizeof(cl_uint));
+    cl_check(err, "Resetting strip are_diff");
+    for (int i=0; i<steps; i++) {
+        strip.kernel_automaton_global.setArg(3, strip.lattice[strip.current]);
+        strip.kernel_automaton_global.setArg(4, strip.labels[strip.current]);
+        strip.kernel_automaton_global.setArg(5, strip.lattice[1-strip.current]);
+        strip.kernel_automaton_global.setArg(6, strip.labels[1-strip.current]);
+        strip.kernel_automaton_global.setArg(7, strip.are_diff);
+        enqueue_strip_rows(strip, strip.kernel_automaton_global, strip.row_begin, strip.row_end, "Running strip automaton kernel");
+        strip.current = 1-strip.current;
+    }
+}
+
+void read_strip_row(STRIP_DEVICE &strip, int row, std::vector<cl_uint> &lattice, std::vector<cl_uint> &labels) {
+    size_t offset = sizeof(cl_uint)*row*strip.width;
+    size_t size = sizeof(cl_uint)*strip.width;
+    lattice.resize(strip.width);
+    labels.resize(strip.width);
+    cl_int err = strip.queue.enqueueReadBuffer(strip.lattice[strip.current], CL_FALSE, offset, size, &lattice[0]);
+    cl_check(err, "Reading strip halo lattice");
+    err = strip.queue.enqueueReadBuffer(strip.labels[strip.current], CL_FALSE, offset, size, &labels[0]);
+    cl_check(err, "Reading strip halo labels");
+}
+
+void write_strip_row(STRIP_DEVICE &strip, int row, std::vector<cl_uint> &lattice, std::vector<cl_uint> &labels) {
+    // into both buffers, the next step may read either
+    size_t offset = sizeof(cl_uint)*row*strip.width;
+    size_t size = sizeof(cl_uint)*strip.width;
+    for (int i=0; i<2; i++) {
+        cl_int err = strip.queue.enqueueWriteBuffer(strip.lattice[i], CL_FALSE, offset, size, &lattice[0]);
+        cl_check(err, "Writing strip halo lattice");
+        err = strip.queue.enqueueWriteBuffer(strip.labels[i], CL_FALSE, offset, size, &labels[0]);
+        cl_check(err, "Writing strip halo labels");
+    }
+}
+
+/*
+    Runs the watershed of an RGBA image over the strip devices and gathers
+    the resulting labels on the host. Returns the number of exchange rounds.
+ */
+int run_strips(
+        std::vector<STRIP_DEVICE> &strips,
+        const std::string &source,
+        const BMPVEC &rgba,
+        int width,
+        int height,
+        int exchange_interval,
+        bool jit_specialize,
+        std::vector<cl_uint> &labels) {
+
+    cl_int err;
+    size_t active = active_strips(strips, height);
+    bool calibrate = false;
+    for (size_t i=0; i<active; i++) {
+        acquire_strip_device(strips[i], source, width, height, jit_specialize);
+        calibrate = calibrate || strips[i].throughput == 0;
+    }
+    balance_strips(strips, height);
+
+    for (size_t i=0; i<active; i++) {
+        STRIP_DEVICE &strip = strips[i];
+        // the owned rows and their halo, plus one more row for the gradient
+        int luma_begin = std::max(strip.row_begin-2, 0);
+        int luma_end = std::min(strip.row_end+2, height);
+
+        cl::size_t<3> wi_origin;
+        wi_origin[0] = 0;
+        wi_origin[1] = luma_begin;
+        wi_origin[2] = 0;
+        cl::size_t<3> wi_region;
+        wi_region[0] = width;
+        wi_region[1] = luma_end-luma_begin;
+        wi_region[2] = 1;
+        err = strip.queue.enqueueWriteImage(
+                            strip.input_image,
+                            CL_FALSE,
+                            wi_origin,
+                            wi_region,
+                            0,
+                            0,
+                            (void*)(&rgba[(size_t)luma_begin*width*4]));
+        cl_check(err, "Writing strip to device");
+
+        strip.kernel_make_luma_image.setArg(0, strip.input_image);
+        strip.kernel_make_luma_image.setArg(1, strip.luma_image);
+        enqueue_strip_rows(strip, strip.kernel_make_luma_image, luma_begin, luma_end, "Computing strip luma");
+
+        strip.kernel_make_gradient.setArg(0, strip.luma_image);
+        strip.kernel_make_gradient.setArg(1, strip.gradient_image);
+        enqueue_strip_rows(strip, strip.kernel_make_gradient, strip.row_begin-1, strip.row_end+1, "Computing strip gradient");
+
+        // both buffers, halo rows included, start from the initial state
+        strip.kernel_init_t0.setArg(2, width);
+        strip.kernel_init_t0.setArg(3, strip.gradient_image);
+        for (int b=0; b<2; b++) {
+            strip.kernel_init_t0.setArg(0, strip.lattice[b]);
+            strip.kernel_init_t0.setArg(1, strip.labels[b]);
+            enqueue_strip_rows(strip, strip.kernel_init_t0, strip.row_begin-1, strip.row_end+1, "Initializing strip");
+        }
+        strip.current = 0;
+
+        strip.kernel_automaton_global.setArg(0, strip.luma_image);
+        strip.kernel_automaton_global.setArg(1, width);
+        strip.kernel_automaton_global.setArg(2, height);
+        strip.queue.flush();
+    }
+
+    std::vector<cl_uint> diffs(active);
+    std::vector<std::vector<cl_uint> > top_lattice(active), top_labels(active);
+    std::vector<std::vector<cl_uint> > bottom_lattice(active), bottom_labels(active);
+
+    int max_rounds = (std::max(width, height)+1)/exchange_interval + active + 1;
+    int rounds = 0;
+    bool converged = false;
+    while (!converged && rounds < max_rounds) {
+
+        if (calibrate && rounds == 0) {
+            // time the devices one at a time on the first round, on their (even) strips
+            for (size_t i=0; i<active; i++) {
+                strips[i].queue.finish();
+                auto start = std::chrono::high_resolution_clock::now();
+                enqueue_strip_steps(strips[i], exchange_interval);
+                strips[i].queue.finish();
+                double time = std::chrono::duration<double>(
+                    std::chrono::high_resolution_clock::now() - start).count();
+                strips[i].throughput =
+                    (double)width*(strips[i].row_end-strips[i].row_begin)*exchange_interval / std::max(time, 1e-9);
+            }
+        }
+        else {
+            for (size_t i=0; i<active; i++) {
+                enqueue_strip_steps(strips[i], exchange_interval);
+                strips[i].queue.flush();
+            }
+        }
+
+        // global convergence: no device changed anything in the whole round,
+        // including the first step which saw the last exchanged halos
+        for (size_t i=0; i<active; i++) {
+            strips[i].queue.enqueueReadBuffer(strips[i].are_diff, CL_FALSE, 0, sizeof(cl_uint), &diffs[i]);
+            read_strip_row(strips[i], strips[i].row_begin, top_lattice[i], top_labels[i]);
+            read_strip_row(strips[i], strips[i].row_end-1, bottom_lattice[i], bottom_labels[i]);
+        }
+        converged = true;
+        for (size_t i=0; i<active; i++) {
+            strips[i].queue.finish();
+            converged = converged && diffs[i] == 0;
+        }
+        rounds++;
+        if (converged) break;
+
+        for (size_t i=0; i<active; i++) {
+            if (i > 0) write_strip_row(strips[i], strips[i].row_begin-1, bottom_lattice[i-1], bottom_labels[i-1]);
+            if (i < active-1) write_strip_row(strips[i], strips[i].row_end, top_lattice[i+1], top_labels[i+1]);
+            strips[i].queue.flush();
+        }
+        // the host rows must outlive the writes
+        for (size_t i=0; i<active; i++) strips[i].queue.finish();
+    }
+
+    if (!converged) {
+        std::cout << "Baling out early from strip exchange at round #" << rounds << std::endl;
+    }
+
+    labels.resize((size_t)width*height);
+    for (size_t i=0; i<active; i++) {
+        STRIP_DEVICE &strip = strips[i];
+        err = strip.queue.enqueueReadBuffer(
+                    strip.labels[strip.current],
+                    CL_FALSE,
+                    sizeof(cl_uint)*strip.row_begin*width,
+                    sizeof(cl_uint)*(strip.row_end-strip.row_begin)*width,
+                    &labels[(size_t)strip.row_begin*width]);
+        cl_check(err, "Reading strip labels");
+    }
+    for (size_t i=0; i<active; i++) strips[i].queue.finish();
+
+    return rounds;
+}
+
+void print_strips(const std::vector<STRIP_DEVICE> &strips) {
+    for (size_t i=0; i<strips.size(); i++) {
+        if (strips[i].row_begin == strips[i].row_end) continue; // idle on this frame
+        std::cout << TERM_CYAN <<
+            "Strip #" << i << ": rows " << strips[i].row_begin << "-" << strips[i].row_end-1 <<
+            " on " << strips[i].device.getInfo<CL_DEVICE_NAME>() <<
+            " (" << strips[i].throughput/1e6 << " Mpixel steps/s)" <<
+            TERM_RESET << std::endl;
+    }
+}
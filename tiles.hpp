@@ -0,0 +1,203 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+/*
+    Out of core watershed: luma, gradient, lattice and labels stay in host
+    memory and tile_size x tile_size tiles (plus a one pixel halo) are
+    streamed through the device, so neither the device memory nor its
+    image size limits bound the image size.
+    A tile is iterated on the device until it converges given its halo
+    (quietly: only the totals over every tile visit are reported);
+    if that changed its border, the tiles next to it are marked dirty,
+    since their halo is now stale. Only dirty tiles are uploaded, and the
+    whole image has converged once no tile is dirty.
+    The costs converge to the global automaton's, but a tile relaxes against
+    a halo that is already ahead of its own steps, so where a pixel is
+    reached at the same cost from two seeds its label can differ from the
+    global automaton's.
+ */
+typedef struct tagTILED_ENGINE {
+    int tile_size;
+    cl::Buffer luma;
+    cl::Buffer lattice[2];
+    cl::Buffer labels[2];
+    std::vector<cl::Buffer> flags; // convergence flags, shared by every tile visit
+    int allocated; // tile size the buffers were allocated for
+} TILED_ENGINE;
+
+typedef struct tagTILED_STATS {
+    int tiles;
+    int visits; // tiles uploaded and iterated
+    int steps;
+    int sweeps;
+} TILED_STATS;
+
+void init_tiled_engine(TILED_ENGINE &engine, int tile_size) {
+    engine.tile_size = tile_size;
+    engine.allocated = 0;
+}
+
+void acquire_tiled_engine(TILED_ENGINE &engine, cl::Context &context) {
+    if (engine.allocated == engine.tile_size) return;
+    size_t cells = (size_t)(engine.tile_size+2)*(engine.tile_size+2);
+    engine.luma = cl::Buffer(context, CL_MEM_READ_ONLY, cells);
+    for (int i=0; i<2; i++) {
+        engine.lattice[i] = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*cells);
+        engine.labels[i] = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint)*cells);
+    }
+    engine.allocated = engine.tile_size;
+}
+
+TILED_STATS run_tiled(
+        TILED_ENGINE &engine,
+        cl::Context &context,
+        cl::CommandQueue &queue,
+        cl::Kernel &kernel_automaton_tile,
+        const std::vector<uint8_t> &luma,
+        const std::vector<uint8_t> &gradient,
+        int width,
+        int height,
+        int sync_interval,
+        std::vector<cl_uint> &lattice,
+        std::vector<cl_uint> &labels) {
+
+    cl_int err;
+    acquire_tiled_engine(engine, context);
+
+    // same as init_t0
+    lattice.resize((size_t)width*height);
+    labels.resize((size_t)width*height);
+    for (size_t i=0; i<lattice.size(); i++) {
+        lattice[i] = gradient[i] == 0 ? 0 : UINT32_MAX;
+        labels[i] = gradient[i] == 0 ? (cl_uint)i : 0;
+    }
+
+    int ts = engine.tile_size;
+    int tiles_x = (width+ts-1)/ts;
+    int tiles_y = (height+ts-1)/ts;
+    std::vector<char> dirty(tiles_x*tiles_y, 1);
+
+    std::vector<uint8_t> tile_luma;
+    std::vector<cl_uint> tile_lattice;
+    std::vector<cl_uint> tile_labels;
+    std::vector<cl_uint> result_lattice;
+    std::vector<cl_uint> result_labels;
+
+    TILED_STATS stats = {tiles_x*tiles_y, 0, 0, 0};
+    bool any_dirty = true;
+    while (any_dirty) {
+        any_dirty = false;
+        stats.sweeps++;
+
+        for (int ty=0; ty<tiles_y; ty++) {
+            for (int tx=0; tx<tiles_x; tx++) {
+                if (!dirty[tx + ty*tiles_x]) continue;
+                dirty[tx + ty*tiles_x] = 0;
+
+                int x0 = tx*ts;
+                int y0 = ty*ts;
+                int tw = std::min(ts, width-x0);
+                int th = std::min(ts, height-y0);
+                int hw = tw+2; // halo included
+                int hh = th+2;
+
+                // gather the tile and its halo, MAX_INT (never wins) outside of the image
+                tile_luma.assign((size_t)hw*hh, 0);
+                tile_lattice.assign((size_t)hw*hh, UINT32_MAX);
+                tile_labels.assign((size_t)hw*hh, 0);
+                for (int y=std::max(y0-1, 0); y<std::min(y0+th+1, height); y++) {
+                    int xb = std::max(x0-1, 0);
+                    int xe = std::min(x0+tw+1, width);
+                    size_t src = (size_t)y*width + xb;
+                    size_t dst = (size_t)(y-y0+1)*hw + (xb-x0+1);
+                    memcpy(&tile_luma[dst], &luma[src], xe-xb);
+                    memcpy(&tile_lattice[dst], &lattice[src], sizeof(cl_uint)*(xe-xb));
+                    memcpy(&tile_labels[dst], &labels[src], sizeof(cl_uint)*(xe-xb));
+                }
+
+                size_t cells = (size_t)hw*hh;
+                err = queue.enqueueWriteBuffer(engine.luma, CL_FALSE, 0, cells, &tile_luma[0]);
+                cl_check(err, "Writing tile luma");
+                for (int i=0; i<2; i++) {
+                    err = queue.enqueueWriteBuffer(engine.lattice[i], CL_FALSE, 0, sizeof(cl_uint)*cells, &tile_lattice[0]);
+                    cl_check(err, "Writing tile lattice");
+                    err = queue.enqueueWriteBuffer(engine.labels[i], CL_FALSE, 0, sizeof(cl_uint)*cells, &tile_labels[0]);
+                    cl_check(err, "Writing tile labels");
+                }
+
+                kernel_automaton_tile.setArg(0, engine.luma);
+                kernel_automaton_tile.setArg(1, hw);
+
+                int current = 0;
+                AUTOMATON_STATS tile_stats = run_automaton_loop(
+                            context,
+                            queue,
+                            tw+th+2,
+                            sync_interval,
+                            1,
+                            false,
+                            [&](cl::Buffer& are_diff, std::vector<cl::Event>* events) {
+                    kernel_automaton_tile.setArg(2, engine.lattice[current]);
+                    kernel_automaton_tile.setArg(3, engine.labels[current]);
+                    kernel_automaton_tile.setArg(4, engine.lattice[1-current]);
+                    kernel_automaton_tile.setArg(5, engine.labels[1-current]);
+                    kernel_automaton_tile.setArg(6, are_diff);
+
+                    enqueue_kernel(
+                                queue,
+                                kernel_automaton_tile,
+                                cl::NDRange(1, 1),
+                                cl::NDRange(tw, th),
+                                cl::NullRange,
+                                events,
+                                "Running tile automaton kernel");
+
+                    current = 1-current;
+                    return 1;
+                }, false, &engine.flags);
+                stats.visits++;
+                stats.steps += tile_stats.steps;
+
+                result_lattice.resize(cells);
+                result_labels.resize(cells);
+                err = queue.enqueueReadBuffer(engine.lattice[current], CL_FALSE, 0, sizeof(cl_uint)*cells, &result_lattice[0]);
+                cl_check(err, "Reading tile lattice");
+                err = queue.enqueueReadBuffer(engine.labels[current], CL_TRUE, 0, sizeof(cl_uint)*cells, &result_labels[0]);
+                cl_check(err, "Reading tile labels");
+
+                // scatter back, noting which borders changed
+                bool changed_north = false, changed_south = false, changed_west = false, changed_east = false;
+                for (int y=0; y<th; y++) {
+                    size_t src = (size_t)(y+1)*hw + 1;
+                    size_t dst = (size_t)(y0+y)*width + x0;
+                    if (memcmp(&result_lattice[src], &lattice[dst], sizeof(cl_uint)*tw) ||
+                        memcmp(&result_labels[src], &labels[dst], sizeof(cl_uint)*tw)) {
+                        if (y == 0) changed_north = true;
+                        if (y == th-1) changed_south = true;
+                        if (result_lattice[src] != lattice[dst] || result_labels[src] != labels[dst])
+                            changed_west = true;
+                        if (result_lattice[src+tw-1] != lattice[dst+tw-1] || result_labels[src+tw-1] != labels[dst+tw-1])
+                            changed_east = true;
+                        memcpy(&lattice[dst], &result_lattice[src], sizeof(cl_uint)*tw);
+                        memcpy(&labels[dst], &result_labels[src], sizeof(cl_uint)*tw);
+                    }
+                }
+
+                if (!tile_stats.converged) dirty[tx + ty*tiles_x] = 1;
+                if (changed_north && ty > 0) dirty[tx + (ty-1)*tiles_x] = 1;
+                if (changed_south && ty < tiles_y-1) dirty[tx + (ty+1)*tiles_x] = 1;
+                if (changed_west && tx > 0) dirty[tx-1 + ty*tiles_x] = 1;
+                if (changed_east && tx < tiles_x-1) dirty[tx+1 + ty*tiles_x] = 1;
+            }
+        }
+
+        for (size_t i=0; i<dirty.size(); i++) any_dirty = any_dirty || dirty[i];
+    }
+
+    return stats;
+}